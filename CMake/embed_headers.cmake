@@ -0,0 +1,32 @@
+# cmake -DRESOURCE_DIR=... -DOUTPUT=... -P embed_headers.cmake
+#
+# Writes OUTPUT, for src/resources.cpp to include: every file under
+# RESOURCE_DIR as a NUL-terminated array, and a resource_headers[] table
+# of their paths relative to RESOURCE_DIR.
+
+file(GLOB_RECURSE files RELATIVE "${RESOURCE_DIR}" "${RESOURCE_DIR}/*")
+list(SORT files)
+
+set(data "")
+set(table "")
+set(n 0)
+
+foreach(file ${files})
+  file(READ "${RESOURCE_DIR}/${file}" hex HEX)
+  string(LENGTH "${hex}" size)
+  math(EXPR size "${size} / 2")
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+
+  string(APPEND data "static const unsigned char resource_${n}[] = {${hex}0};\n")
+  string(APPEND table "    { \"${file}\", resource_${n}, ${size} },\n")
+  math(EXPR n "${n} + 1")
+endforeach()
+
+file(WRITE "${OUTPUT}.tmp"
+  "// Generated from ${RESOURCE_DIR} by embed_headers.cmake\n\n"
+  "${data}\n"
+  "static const embedded_file resource_headers[] = {\n"
+  "${table}"
+  "    { 0, 0, 0 }\n"
+  "};\n")
+file(RENAME "${OUTPUT}.tmp" "${OUTPUT}")
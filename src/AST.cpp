@@ -42,9 +42,12 @@
 #include <llvm/Support/Host.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/ConvertUTF.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 
 #include "c2ffi.h"
 #include "c2ffi/ast.h"
+#include "c2ffi/visitor.h"
 
 using namespace c2ffi;
 
@@ -66,7 +69,7 @@ static std::string value_to_string(clang::APValue* v)
 
 void C2FFIASTConsumer::HandleTopLevelDeclInObjCContainer(clang::DeclGroupRef d)
 {
-    _od->write_comment("HandleTopLevelDeclInObjCContainer");
+    if(_od) _od->write_comment("HandleTopLevelDeclInObjCContainer");
 }
 
 Decl* C2FFIASTConsumer::proc(const clang::Decl* d, Decl* decl)
@@ -77,6 +80,12 @@ Decl* C2FFIASTConsumer::proc(const clang::Decl* d, Decl* decl)
 
     if(decl->location() == "") decl->set_location(_ci, d);
 
+    if(_config.visitor)
+        _config.visitor->visit(*decl, d);
+
+    if(!_od)
+        return decl;
+
     if(_mid)
         _od->write_between();
     else
@@ -94,9 +103,32 @@ void C2FFIASTConsumer::HandleDecl(clang::Decl* d, const clang::NamedDecl* ns)
     const clang::NamedDecl* old_ns = _ns;
     _ns                            = ns;
 
+    // Namespaces and records are still searched for the symbols in them
+    if(has_symbols() && !(_config.reachable ? is_reachable(d) : is_symbol(d))) {
+        if_cast(x, clang::RecordDecl, d) HandleDeclContext(x, x);
+
+        _ns = old_ns;
+        return;
+    }
+
+    // --exclude-namespace drops the namespace and everything in it
+    if_cast(x, clang::NamespaceDecl, d)
+    {
+        if(!_exclude_ns.empty() && is_excluded(x)) {
+            _ns = old_ns;
+            return;
+        }
+    }
+
+    // Nothing from other files is converted, or even checked
+    if(!_config.only_from.empty() && !in_only_from(d)) {
+        _ns = old_ns;
+        return;
+    }
+
     if(d->isInvalidDecl()) {
-        std::cerr << "Skipping invalid Decl:" << std::endl;
-        d->dump();
+        _config.diag() << "Skipping invalid Decl:\n";
+        d->dump(_config.diag());
         return;
     }
 
@@ -159,17 +191,305 @@ void C2FFIASTConsumer::HandleDeclContext(const clang::DeclContext* dc, const cla
     for(it = dc->decls_begin(); it != dc->decls_end(); ++it) HandleDecl(*it, ns);
 }
 
+// An import stands in for the #include it replaced, so the decls of the
+// module, its submodules and the modules it imports are handed on in its
+// place.  Like a header guard, each module only comes in once.
+bool C2FFIASTConsumer::HandleImport(const clang::ImportDecl* d)
+{
+    std::vector<const clang::Module*> todo = { d->getImportedModule() };
+    std::set<const clang::Module*>    mods;
+    std::vector<clang::Decl*>         decls;
+
+    while(!todo.empty()) {
+        const clang::Module* m = todo.back();
+        todo.pop_back();
+
+        if(!m || !_imported.insert(m).second) continue;
+        mods.insert(m);
+
+        todo.insert(todo.end(), m->submodule_begin(), m->submodule_end());
+        todo.insert(todo.end(), m->Imports.begin(), m->Imports.end());
+    }
+
+    for(clang::Decl* x : _ci.getASTContext().getTranslationUnitDecl()->decls()) {
+        if(!x->isImplicit() && mods.count(x->getOwningModule()))
+            decls.push_back(x);
+    }
+
+    for(clang::Decl* x : decls) {
+        if(!HandleTopLevelDecl(clang::DeclGroupRef(x)))
+            return false;
+    }
+
+    return true;
+}
+
 bool C2FFIASTConsumer::HandleTopLevelDecl(clang::DeclGroupRef d)
 {
     clang::DeclGroupRef::iterator it;
 
-    for(it = d.begin(); it != d.end(); ++it) HandleDecl(*it);
+    for(it = d.begin(); it != d.end(); ++it) {
+        if_cast(x, clang::ImportDecl, *it)
+        {
+            if(!HandleImport(x)) return false;
+        }
+        else if(_config.reachable) {
+            _pending.push_back(*it);
+
+            // --stop-early needs to know when everything they use is in
+            if(_config.stop_early) find_roots(*it);
+        }
+        else
+            HandleDecl(*it);
+    }
+
+    if(!_config.stop_early) return true;
+
+    // Returning false ends ParseAST() here
+    return !(_found.size() == _config.symbols.size() && _incomplete.empty());
+}
+
+void C2FFIASTConsumer::add_only_from(const std::string& pattern)
+{
+    if(pattern.find_first_of("*?[") == std::string::npos) {
+        llvm::SmallString<256> path(pattern);
+        llvm::sys::fs::make_absolute(path);
+        llvm::sys::path::remove_dots(path, true);
+        _from_paths.push_back(path.str().str());
+    } else if(auto glob = llvm::GlobPattern::create(pattern)) {
+        _from_globs.push_back(std::move(*glob));
+    } else {
+        llvm::consumeError(glob.takeError());
+    }
+}
+
+bool C2FFIASTConsumer::in_only_from(const clang::Decl* d)
+{
+    if(llvm::isa<clang::NamespaceDecl>(d)) return true;
+
+    clang::SourceManager& sm  = _ci.getSourceManager();
+    clang::PresumedLoc    loc = sm.getPresumedLoc(sm.getExpansionLoc(d->getLocation()));
+    if(loc.isInvalid()) return false;
+
+    auto it = _from_files.find(loc.getFilename());
+    if(it != _from_files.end()) return it->second;
+
+    // A path is that file or anything under it; a glob can match either
+    // the name as it was included or the absolute path
+    llvm::SmallString<256> path(loc.getFilename());
+    llvm::sys::fs::make_absolute(path);
+    llvm::sys::path::remove_dots(path, true);
+
+    bool match = false;
+    for(auto&& p : _from_paths)
+        match = match || path == p || path.startswith(p + "/");
+    for(auto&& g : _from_globs)
+        match = match || g.match(loc.getFilename()) || g.match(path);
+
+    _from_files[loc.getFilename()] = match;
+    return match;
+}
+
+bool C2FFIASTConsumer::is_symbol(const clang::Decl* d)
+{
+    if(llvm::isa<clang::NamespaceDecl>(d)) return true;
+
+    const clang::TagDecl* tag = llvm::dyn_cast<clang::TagDecl>(d);
+    if(tag && tag->isThisDeclarationADefinition()) {
+        auto it = _waiting.find(tag->getCanonicalDecl());
+        if(it != _waiting.end()) {
+            _found.insert(it->second.begin(), it->second.end());
+            _waiting.erase(it);
+        }
+    }
+
+    const clang::NamedDecl* nd = llvm::dyn_cast<clang::NamedDecl>(d);
+    if(!nd || !nd->getDeclName()) return false;
+
+    std::string name = nd->getNameAsString();
+    if(!_config.symbols.count(name)) {
+        std::string qualified = nd->getQualifiedNameAsString();
+
+        if(!_config.symbols.count(qualified)) {
+            for(auto&& re : _symbol_regex)
+                if(re.match(name) || re.match(qualified)) return true;
+            return false;
+        }
+
+        name = qualified;
+    }
+
+    // A struct, union or enum, or a typedef of one, isn't done with until
+    // the definition has been seen
+    if_const_cast(td, clang::TypedefNameDecl, d) tag = td->getUnderlyingType()->getAsTagDecl();
+
+    if(!tag || tag->getDefinition())
+        _found.insert(name);
+    else
+        _waiting[tag->getCanonicalDecl()].insert(name);
 
     return true;
 }
 
+void C2FFIASTConsumer::find_roots(const clang::Decl* d)
+{
+    // A tag reached before it was defined is reached again now it is
+    const clang::TagDecl* tag = llvm::dyn_cast<clang::TagDecl>(d);
+    if(tag && tag->isThisDeclarationADefinition() &&
+       _incomplete.erase(tag->getCanonicalDecl())) {
+        _reachable.erase(tag->getCanonicalDecl());
+        reach(tag);
+    }
+
+    if(is_symbol(d) && !llvm::isa<clang::NamespaceDecl>(d)) reach(d);
+
+    if(llvm::isa<clang::NamespaceDecl>(d) || llvm::isa<clang::RecordDecl>(d))
+        for(const clang::Decl* x : clang::Decl::castToDeclContext(d)->decls()) find_roots(x);
+}
+
+// Everything D's output refers to by name: the types of functions,
+// variables and fields, typedef targets, and base classes
+void C2FFIASTConsumer::reach(const clang::Decl* d)
+{
+    if(!d || !_reachable.insert(d->getCanonicalDecl()).second) return;
+
+    if_const_cast(x, clang::FunctionDecl, d) reach_type(x->getType());
+    else if_const_cast(x, clang::VarDecl, d) reach_type(x->getType());
+    else if_const_cast(x, clang::TypedefNameDecl, d) reach_type(x->getUnderlyingType());
+    else if_const_cast(x, clang::TagDecl, d)
+    {
+        if(!x->getDefinition()) {
+            _incomplete.insert(x->getCanonicalDecl());
+            return;
+        }
+
+        const clang::RecordDecl* def = llvm::dyn_cast<clang::RecordDecl>(x->getDefinition());
+        if(!def) return;
+
+        for(const clang::FieldDecl* f : def->fields()) reach_type(f->getType());
+
+        if_const_cast(cxx, clang::CXXRecordDecl, def)
+        {
+            for(auto&& base : cxx->bases()) reach_type(base.getType());
+            for(const clang::CXXMethodDecl* m : cxx->methods()) reach_type(m->getType());
+        }
+    }
+    else if_const_cast(x, clang::ObjCInterfaceDecl, d)
+    {
+        reach(x->getSuperClass());
+        for(auto i = x->ivar_begin(); i != x->ivar_end(); ++i) reach_type((*i)->getType());
+    }
+}
+
+void C2FFIASTConsumer::reach_type(clang::QualType q)
+{
+    const clang::Type* t = q.getTypePtrOrNull();
+    if(!t) return;
+
+    if_const_cast(td, clang::TypedefType, t) reach(td->getDecl());
+    else if_const_cast(tag, clang::TagType, t) reach(tag->getDecl());
+    else if_const_cast(op, clang::ObjCObjectType, t) reach(op->getInterface());
+    else if_const_cast(fp, clang::FunctionProtoType, t)
+    {
+        reach_type(fp->getReturnType());
+        for(clang::QualType p : fp->getParamTypes()) reach_type(p);
+    }
+    else if_const_cast(f, clang::FunctionType, t) reach_type(f->getReturnType());
+    else if(t->isPointerType() || t->isReferenceType() || t->isObjCObjectPointerType() ||
+            t->isBlockPointerType())
+        reach_type(t->getPointeeType());
+    else if(const clang::ArrayType* a = t->getAsArrayTypeUnsafe())
+        reach_type(a->getElementType());
+    else if(const clang::ComplexType* c = t->getAs<clang::ComplexType>())
+        reach_type(c->getElementType());
+    else {
+        // Parens, attributes, elaborated names, template specializations...
+        clang::QualType next = t->getLocallyUnqualifiedSingleStepDesugaredType();
+        if(next.getTypePtr() != t) reach_type(next);
+    }
+}
+
+bool C2FFIASTConsumer::is_excluded(const clang::NamespaceDecl* ns)
+{
+    auto it = _excluded.find(ns);
+    if(it != _excluded.end()) return it->second;
+
+    std::string name     = ns->getQualifiedNameAsString();
+    bool        excluded = false;
+
+    for(auto&& g : _exclude_ns) excluded = excluded || g.match(name);
+
+    _excluded[ns] = excluded;
+    return excluded;
+}
+
+bool C2FFIASTConsumer::in_excluded(const clang::Decl* d)
+{
+    for(const clang::DeclContext* dc = d->getDeclContext(); dc; dc = dc->getParent()) {
+        if_const_cast(ns, clang::NamespaceDecl, dc)
+        {
+            if(is_excluded(ns)) return true;
+        }
+    }
+
+    return false;
+}
+
+void C2FFIASTConsumer::write_ns(const clang::NamespaceDecl* ns)
+{
+    if(!_written_ns.insert(ns).second) return;
+
+    const clang::NamespaceDecl* parent = llvm::dyn_cast<clang::NamespaceDecl>(ns->getDeclContext());
+    if(parent) write_ns(parent);
+
+    const clang::NamedDecl* old_ns = _ns;
+    _ns                            = parent;
+
+    if(Decl* decl = proc(ns, make_decl(ns))) delete decl;
+    _ns = old_ns;
+}
+
+// --keep-used-records: the records, and namespace-level typedefs, in
+// excluded namespaces that what was written refers to, along with the
+// namespaces they're in.  Writing them can use more, which are written
+// in turn.
+void C2FFIASTConsumer::write_used_records()
+{
+    for(size_t i = 0; i < _used_tags.size(); i++) {
+        const clang::Decl* d = _used_tags[i];
+        if(!in_excluded(d)) continue;
+
+        if_const_cast(rd, clang::RecordDecl, d) d = rd->getDefinition() ? rd->getDefinition() : rd;
+        else if(!llvm::isa<clang::TypedefNameDecl>(d) ||
+                !llvm::isa<clang::NamespaceDecl>(d->getDeclContext()))
+            continue;
+
+        const clang::Decl*      parent = clang::Decl::castFromDeclContext(d->getDeclContext());
+        const clang::NamedDecl* ns     = llvm::dyn_cast<clang::NamedDecl>(parent);
+
+        if_const_cast(x, clang::NamespaceDecl, parent) write_ns(x);
+
+        HandleDecl(const_cast<clang::Decl*>(d), ns);
+    }
+}
+
+bool C2FFIASTConsumer::is_reachable(const clang::Decl* d) const
+{
+    return llvm::isa<clang::NamespaceDecl>(d) || _reachable.count(d->getCanonicalDecl());
+}
+
 void C2FFIASTConsumer::PostProcess()
 {
+    if(_config.reachable) {
+        // With --stop-early, each was looked at as it came in
+        if(!_config.stop_early)
+            for(clang::Decl* d : _pending) find_roots(d);
+        for(clang::Decl* d : _pending) HandleDecl(d);
+        _pending.clear();
+    }
+
+    if(_config.keep_used_records) write_used_records();
+
     if(!_config.template_output) return;
 
     std::ofstream& out = *_config.template_output;
@@ -336,8 +656,8 @@ Decl* C2FFIASTConsumer::make_decl(const clang::TypedefDecl* d, bool is_toplevel)
     if(is_underlying_valid(t)) {
         return new TypedefDecl(d->getDeclName().getAsString(), Type::make_type(this, t));
     } else {
-        std::cerr << "Skipping typedef to invalid type:" << std::endl;
-        d->dump();
+        _config.diag() << "Skipping typedef to invalid type:\n";
+        d->dump(_config.diag());
         return NULL;
     }
 }
@@ -96,6 +96,13 @@ Type* Type::make_type(C2FFIASTConsumer *ast, const clang::Type *t) {
 
     if_const_cast(td, clang::TypedefType, t) {
         const clang::TypedefNameDecl *tdd = td->getDecl();
+
+        // The output only has the typedef's name, which needs both it and
+        // what it names (std::string is basic_string<char>)
+        ast->use_tag_decl(tdd);
+        if(const clang::TagDecl *tag = td->getAsTagDecl())
+            ast->use_tag_decl(tag);
+
         return new SimpleType(ci, td, tdd->getDeclName().getAsString());
     }
 
@@ -130,6 +137,8 @@ Type* Type::make_type(C2FFIASTConsumer *ast, const clang::Type *t) {
     if_const_cast(rt, clang::RecordType, t) {
         clang::RecordDecl *rd = rt->getDecl();
 
+        ast->use_tag_decl(rd);
+
         if(rd->isInvalidDecl())
             return new SimpleType(ci, t, std::string("<invalid-type:") +
                                   t->getTypeClassName() + ">");
@@ -157,6 +166,8 @@ Type* Type::make_type(C2FFIASTConsumer *ast, const clang::Type *t) {
     if_const_cast(ed, clang::EnumType, t) {
         std::string name = ed->getDecl()->getDeclName().getAsString();
 
+        ast->use_tag_decl(ed->getDecl());
+
         if(ed->getDecl()->isThisDeclarationADefinition() &&
            !ast->is_cur_decl(ed->getDecl()))
             return new DeclType(ci, t, ast->make_decl(ed->getDecl(), false),
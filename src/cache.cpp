@@ -0,0 +1,315 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+
+#include <clang/Basic/Version.h>
+
+#include "c2ffi.h"
+#include "c2ffi/cache.h"
+#include "c2ffi/resources.h"
+
+using namespace c2ffi;
+
+static std::string hex(uint64_t n) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)n);
+    return buf;
+}
+
+// A different c2ffi could write something different, or link a different
+// clang and so run a different driver.  This is the file this code was
+// loaded from: libc2ffi.so when that's in another program, and the
+// executable when it's linked in.
+static std::string exe_id(const config &c) {
+    struct stat exe_stat{};
+    Dl_info info{};
+    std::string exe;
+
+    if(dladdr((void*)&hex, &info) && info.dli_fname && *info.dli_fname)
+        exe = info.dli_fname;
+    else
+        exe = llvm::sys::fs::getMainExecutable(c.c2ffi_binpath.c_str(), (void*)&hex);
+    stat(exe.c_str(), &exe_stat);
+
+    std::ostringstream id;
+    id << exe << ' ' << exe_stat.st_mtime << ' ' << exe_stat.st_size;
+    return id.str();
+}
+
+// What else the driver looks at: the environment, and the GCC
+// installations under these.  Installing a new version adds a directory
+// under the target's, which changes that one's mtime.
+static const char *const driver_env[] = {
+    "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH",
+    "COMPILER_PATH"
+};
+static const char *const gcc_roots[] = {
+    "/usr/lib/gcc", "/usr/lib/gcc-cross", "/usr/lib32/gcc", "/usr/lib64/gcc",
+    "/usr/libx32/gcc"
+};
+
+static std::string toolchain_id() {
+    std::ostringstream id;
+    std::vector<std::string> dirs;
+
+    for(const char *var : driver_env) {
+        const char *value = getenv(var);
+        if(value)
+            id << var << '=' << value << '\n';
+    }
+
+    for(const char *root : gcc_roots) {
+        std::error_code ec;
+
+        dirs.push_back(root);
+        for(llvm::sys::fs::directory_iterator it(root, ec), end; it != end && !ec;
+            it.increment(ec))
+            dirs.push_back(it->path());
+    }
+
+    // The order the directories are listed in doesn't matter
+    std::sort(dirs.begin(), dirs.end());
+    for(auto &&dir : dirs) {
+        struct stat st;
+        if(stat(dir.c_str(), &st) == 0)
+            id << dir << ' ' << st.st_mtime << '\n';
+    }
+
+    return id.str();
+}
+
+static std::string arguments_path(const config &c, const std::string &key) {
+    std::string id = "c2ffi-cc1 1\n" + exe_id(c) + '\n' + c.c2ffi_binpath + '\n' +
+        clang::getClangFullVersion() + '\n' + toolchain_id() + key;
+
+    return c.cache_dir + "/" + hex(llvm::xxHash64(id)) + ".cc1";
+}
+
+bool c2ffi::load_arguments(const config &c, const std::string &key, std::string &args) {
+    if(c.cache_dir.empty())
+        return false;
+
+    std::ifstream in(arguments_path(c, key), std::ios::binary);
+    if(!read_section(in, args))
+        return false;
+
+    // A GCC upgrade takes the old version's directories with it; the
+    // driver has to look again
+    auto fs = file_system();
+    llvm::StringRef prev;
+    for(size_t i = 0; i < args.size(); i += strlen(&args[i]) + 1) {
+        llvm::StringRef arg(&args[i]);
+
+        if((prev == "-internal-isystem" || prev == "-internal-externc-isystem" ||
+            prev == "-isystem" || prev == "-resource-dir")) {
+            auto st = fs->status(arg);
+            if(!st || !st->isDirectory()) {
+                args.clear();
+                return false;
+            }
+        }
+
+        prev = arg;
+    }
+
+    return true;
+}
+
+void c2ffi::store_arguments(const config &c, const std::string &key,
+                            const std::string &args) {
+    if(c.cache_dir.empty() || args.empty())
+        return;
+
+    std::ostringstream out;
+    write_section(out, args);
+
+    std::string data = out.str();
+    replace_file(arguments_path(c, key), data.data(), data.size());
+}
+
+OutputCache::OutputCache(config &c, session &s, bool preprocessed)
+    : _dir(c.cache_dir) {
+    std::string args = get_arguments(c, s);
+    if(args.empty())
+        return;
+
+    llvm::SmallString<256> input(c.filename), cwd;
+    llvm::sys::fs::make_absolute(input);
+    // Relative -I directories, and the names in the output, depend on it
+    llvm::sys::fs::current_path(cwd);
+
+    std::ostringstream key;
+    if(preprocessed) {
+        key << "c2ffi-pp 1\n"
+            << exe_id(c) << '\n'
+            << args << '\n'
+            << input.str().str() << '\n'
+            << cwd.str().str() << '\n'
+            << c.wchar_size << ' ' << (int)c.std << ' ' << c.warn_as_error
+            << ' ' << c.error_limit << ' ' << c.fast_parse << '\n';
+    } else {
+        key << "c2ffi-cache 1\n"
+            << exe_id(c) << '\n'
+            << args << '\n'
+            << input.str().str() << '\n'
+            << cwd.str().str() << '\n'
+            << c.driver->name << ' ' << c.to_namespace << ' ' << c.with_macro_defs
+            << ' ' << c.declspec << ' ' << c.wchar_size << ' ' << (int)c.std
+            << ' ' << c.fail_on_error << ' ' << c.warn_as_error << ' ' << c.error_limit
+            << ' ' << (c.macro_output != NULL) << ' ' << (c.template_output != NULL)
+            << ' ' << c.fast_parse << ' ' << c.cache_preprocessed << '\n' << c.pch << '\n';
+
+        key << c.stop_early << ' ' << c.reachable;
+        for(auto &&sym : c.symbols)
+            key << ' ' << sym;
+        key << '\n';
+        for(auto &&re : c.symbol_regex)
+            key << "--symbol-regex " << re << '\n';
+        for(auto &&from : c.only_from)
+            key << "--only-from " << from << '\n';
+        for(auto &&ns : c.exclude_ns)
+            key << "--exclude-namespace " << ns << '\n';
+        key << c.keep_used_records << '\n';
+    }
+
+    for(auto &&inc : c.includes)
+        key << "-I " << inc << '\n';
+    for(auto &&inc : c.sys_includes)
+        key << "-i " << inc << '\n';
+
+    _key = hex(llvm::xxHash64(key.str()));
+}
+
+std::string OutputCache::entry_key(const IncludeVector &deps) const {
+    std::string key = _key;
+
+    for(auto &&dep : deps) {
+        auto buf = llvm::MemoryBuffer::getFile(dep, -1, false);
+        if(!buf)
+            return "";
+
+        key += dep + '\0' + hex(llvm::xxHash64((*buf)->getBuffer())) + '\0';
+    }
+
+    return hex(llvm::xxHash64(key));
+}
+
+static bool read_section(std::istream &in, std::string &s) {
+    size_t size;
+
+    if(!(in >> size) || in.get() != '\n')
+        return false;
+
+    s.resize(size);
+    return (bool)in.read(&s[0], size);
+}
+
+bool OutputCache::lookup(cached_result &r, IncludeVector *out_deps) const {
+    std::ifstream manifest(_dir + "/" + _key + ".manifest");
+    IncludeVector deps;
+    std::string line;
+
+    if(_key.empty())
+        return false;
+
+    while(std::getline(manifest, line))
+        deps.push_back(line);
+
+    std::string entry = deps.empty() ? "" : entry_key(deps);
+    if(entry.empty())
+        return false;
+
+    std::ifstream in(_dir + "/" + entry + ".entry", std::ios::binary);
+    if(!(in >> r.status && in.get() == '\n' &&
+         read_section(in, r.output) && read_section(in, r.macros) &&
+         read_section(in, r.templates) && read_section(in, r.diagnostics)))
+        return false;
+
+    if(out_deps)
+        *out_deps = deps;
+    return true;
+}
+
+void OutputCache::store(const cached_result &r, const IncludeVector &deps,
+                        time_t start) const {
+    if(_key.empty() || deps.empty() || r.status != 0)
+        return;
+
+    std::string manifest;
+    for(auto &&dep : deps) {
+        struct stat buf;
+        if(stat(dep.c_str(), &buf) < 0 || buf.st_mtime >= start)
+            return;
+
+        manifest += dep + "\n";
+    }
+
+    std::string entry = entry_key(deps);
+    if(entry.empty())
+        return;
+
+    std::ostringstream out;
+    for(auto *s : { &r.output, &r.macros, &r.templates, &r.diagnostics })
+        out << s->size() << '\n' << *s;
+
+    std::string data = std::to_string(r.status) + "\n" + out.str();
+
+    // Failing to store isn't worth failing the run for
+    llvm::sys::fs::create_directories(_dir);
+    if(replace_file(_dir + "/" + entry + ".entry", data.data(), data.size()))
+        replace_file(_dir + "/" + _key + ".manifest", manifest.data(), manifest.size());
+}
+
+bool c2ffi::replace_file(const std::string &path, const char *data, size_t size) {
+    // Unique within the process as well, for threads writing the same file
+    static std::atomic<unsigned> serial(0);
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." +
+        std::to_string(serial++);
+    std::ofstream out(tmp, std::ios::binary);
+
+    out.write(data, size);
+    out.close();
+
+    if(!out || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
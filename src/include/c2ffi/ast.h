@@ -24,7 +24,11 @@
 
 #include <set>
 #include <map>
+#include <vector>
 #include <clang/AST/ASTConsumer.h>
+#include <clang/Basic/Module.h>
+#include <llvm/Support/GlobPattern.h>
+#include <llvm/Support/Regex.h>
 #include "c2ffi.h"
 #include "c2ffi/opt.h"
 
@@ -50,9 +54,65 @@ namespace c2ffi {
 
         const clang::NamedDecl *_ns;
 
+        // Which of --symbols have been written, and those waiting for the
+        // definition of the tag they name
+        std::set<std::string> _found;
+        std::map<const clang::Decl*, std::set<std::string>> _waiting;
+        std::vector<llvm::Regex> _symbol_regex;
+        bool has_symbols() const {
+            return !_config.symbols.empty() || !_symbol_regex.empty();
+        }
+        bool is_symbol(const clang::Decl *d);
+
+        // --reachable: the top-level decls, converted at the end once it's
+        // known what the symbols use; the canonical decls they reach; and
+        // the tags among those that haven't been defined yet
+        std::vector<clang::Decl*> _pending;
+        ClangDeclSet _reachable;
+        ClangDeclSet _incomplete;
+        void find_roots(const clang::Decl *d);
+        void reach(const clang::Decl *d);
+        void reach_type(clang::QualType q);
+        bool is_reachable(const clang::Decl *d) const;
+
+        // --exclude-namespace patterns, and what each namespace matched;
+        // with --keep-used-records, the tags types used, in order, and
+        // the namespaces written for the excluded ones
+        std::vector<llvm::GlobPattern> _exclude_ns;
+        std::map<const clang::NamespaceDecl*, bool> _excluded;
+        std::vector<const clang::Decl*> _used_tags;
+        ClangDeclSet _used_set;
+        ClangDeclSet _written_ns;
+        bool is_excluded(const clang::NamespaceDecl *ns);
+        bool in_excluded(const clang::Decl *d);
+        void write_ns(const clang::NamespaceDecl *ns);
+        void write_used_records();
+
+        // Modules whose decls an import has already handed on
+        std::set<const clang::Module*> _imported;
+
+        // --only-from, as absolute paths and globs, and whether each file
+        // decls came from matched, by the SourceManager's name for it
+        IncludeVector _from_paths;
+        std::vector<llvm::GlobPattern> _from_globs;
+        std::map<const char*, bool> _from_files;
+        void add_only_from(const std::string &pattern);
+        bool in_only_from(const clang::Decl *d);
+
     public:
         C2FFIASTConsumer(clang::CompilerInstance &ci, config &config)
-            : _config(config), _ci(ci), _od(config.od), _mid(false), _decl_id(0), _ns() { }
+            : _config(config), _ci(ci), _od(config.od), _mid(false), _decl_id(0), _ns() {
+            for(auto &&pattern : config.only_from)
+                add_only_from(pattern);
+            for(auto &&re : config.symbol_regex)
+                _symbol_regex.emplace_back("^(" + re + ")$");
+            for(auto &&pattern : config.exclude_ns) {
+                if(auto glob = llvm::GlobPattern::create(pattern))
+                    _exclude_ns.push_back(std::move(*glob));
+                else
+                    llvm::consumeError(glob.takeError());
+            }
+        }
 
         clang::CompilerInstance& ci() { return _ci; }
         c2ffi::OutputDriver& od() { return *_od; }
@@ -60,10 +120,15 @@ namespace c2ffi {
         virtual bool HandleTopLevelDecl(clang::DeclGroupRef d);
         virtual void HandleTopLevelDeclInObjCContainer(clang::DeclGroupRef d);
 
+        // Decls loaded from a PCH are handed to HandleTopLevelDecl in
+        // the header's order before the parse (see process.cpp)
+        virtual void HandleInterestingDecl(clang::DeclGroupRef d) { }
+
         void HandleDecl(clang::Decl *d, const clang::NamedDecl *ns = NULL);
         void HandleDeclContext(const clang::DeclContext *dc,
                                const clang::NamedDecl *ns);
         void HandleNS(const clang::NamespaceDecl *ns);
+        bool HandleImport(const clang::ImportDecl *d);
         void PostProcess();
 
         Decl* proc(const clang::Decl*, Decl*);
@@ -89,6 +154,12 @@ namespace c2ffi {
             return 0;
         }
 
+        /* A record, enum or typedef reached while converting a type */
+        void use_tag_decl(const clang::Decl *d) {
+            if(_config.keep_used_records && _used_set.insert(d).second)
+                _used_tags.push_back(d);
+        }
+
         const clang::NamedDecl* ns() const { return _ns; }
 
         Decl* make_decl(const clang::Decl *d, bool is_toplevel = true);
@@ -0,0 +1,83 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_CACHE_H
+#define C2FFI_CACHE_H
+
+#include <string>
+
+#include "c2ffi/opt.h"
+#include "c2ffi/init.h"
+
+namespace c2ffi {
+    /* Everything a run produces */
+    struct cached_result {
+        int status = 1;
+        std::string output;
+        std::string macros;
+        std::string templates;
+        std::string diagnostics;
+    };
+
+    /* The --cache-dir entries for one input.  A manifest, named for a
+       hash of the cc1 arguments, c2ffi's own options, the input and the
+       working directory, lists the files the last parse opened.  The
+       result is stored under a hash of that and the contents of those
+       files, so checking for a hit only reads the dependencies. */
+    class OutputCache {
+        std::string _dir;
+        std::string _key;
+
+        std::string entry_key(const IncludeVector &deps) const;
+
+    public:
+        /* PREPROCESSED picks the entries --cache-preprocessed keeps
+           instead, where the output is the input after -E, and the key
+           is only what preprocessing depends on */
+        OutputCache(config &c, session &s, bool preprocessed = false);
+
+        /* False if the result for the files as they are now isn't cached.
+           DEPS, if given, gets the files it depends on. */
+        bool lookup(cached_result &r, IncludeVector *deps = NULL) const;
+
+        /* DEPS are the files the run opened; nothing is stored if any of
+           them changed since START, as the result may not match, or if
+           the run failed, since it could have failed for reasons that
+           aren't in the key. */
+        void store(const cached_result &r, const IncludeVector &deps,
+                   time_t start) const;
+    };
+
+    /* With --cache-dir, the cc1 arguments the driver gave for KEY (see
+       get_invocation()), so later runs needn't detect the toolchain
+       again.  A hit is only returned if the system include directories it
+       names still exist. */
+    bool load_arguments(const config &c, const std::string &key, std::string &args);
+    void store_arguments(const config &c, const std::string &key,
+                         const std::string &args);
+
+    /* Write a file under a temporary name and rename it into place, so
+       other processes never see it partly written.  Returns false if it
+       couldn't be written. */
+    bool replace_file(const std::string &path, const char *data, size_t size);
+}
+
+#endif /* C2FFI_CACHE_H */
@@ -22,17 +22,79 @@
 #ifndef C2FFI_INIT_H
 #define C2FFI_INIT_H
 
+#include <map>
+#include <memory>
+#include <string>
+
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInvocation.h>
+
 #include "c2ffi.h"
 #include "c2ffi/opt.h"
 
 namespace c2ffi {
-    void add_include(clang::CompilerInstance &ci, const char *path,
+    typedef std::map<std::string, std::shared_ptr<clang::CompilerInvocation>>
+        InvocationMap;
+
+    class StatCache;
+
+    /* State kept between the inputs of a batch run: the driver-derived
+       invocation for each input language and set of driver flags, and a
+       FileManager whose stat cache stays warm from one input to the next. */
+    struct session {
+        InvocationMap invocations;
+        // The cc1 arguments behind each invocation, NUL-separated
+        std::map<std::string, std::string> arguments;
+        llvm::IntrusiveRefCntPtr<clang::FileManager> fm;
+        // Used by new FileManagers when there's no --stat-cache
+        std::shared_ptr<StatCache> stat_cache;
+    };
+
+    /* These return false if a path isn't a directory and show_error is
+       set; the error is reported through ci's diagnostics. */
+    bool add_include(clang::CompilerInstance &ci, const char *path,
                      bool isAngled = false, bool show_error = false);
-    void add_includes(clang::CompilerInstance &ci,
+    bool add_includes(clang::CompilerInstance &ci,
                       c2ffi::IncludeVector &v, bool is_angled = false,
                       bool show_error = false);
 
-    void init_ci(config &c, clang::CompilerInstance &ci);
+    /* A fresh copy of the invocation for c.filename; the clang driver
+       runs only for the first input of each language (and target, -x, --nostdinc
+       and module options) in the session.
+       Returns nullptr if the driver failed. */
+    std::shared_ptr<clang::CompilerInvocation> get_invocation(config &c, session &s);
+
+    /* The cc1 arguments get_invocation() uses, each followed by a NUL,
+       without the ones naming the input.  Empty if the driver failed. */
+    std::string get_arguments(config &c, session &s);
+
+    /* Sets up ci for parsing c.filename.  This keeps no global state, so
+       several instances may be set up and used from different threads as
+       long as they don't share a session.  Errors go to c.diag(), and
+       false is returned.  TU_Prefix sets up for building a PCH, chained
+       onto c.pch if that's set. */
+    bool init_ci(config &c, clang::CompilerInstance &ci, session *s = NULL,
+                 clang::TranslationUnitKind tu = clang::TU_Complete);
+
+    /* The invocation init_ci() would set ci up from, with the rest of
+       what init_ci() does folded into it, for an ASTUnit to parse
+       c.filename with.  Returns nullptr after reporting to c.diag(). */
+    std::shared_ptr<clang::CompilerInvocation> get_unit_invocation(config &c, session &s);
+
+    /* True if c.filename is a serialized AST (.ast or .pch) rather than
+       source */
+    bool is_ast_file(const config &c);
+
+    /* Load the serialized AST c.filename.  Errors go to c.diag(), and
+       NULL is returned. */
+    std::unique_ptr<clang::ASTUnit> load_ast(config &c);
+
+    /* Point ci at unit's managers, preprocessor and context, so it can
+       stand in for one set up by init_ci() */
+    void init_ci_from(config &c, clang::CompilerInstance &ci, clang::ASTUnit &unit);
 }
 
 #endif /* C2FFI_INIT_H */
@@ -23,7 +23,10 @@
 #define C2FFI_OPT_H
 
 #include <clang/Frontend/FrontendOptions.h>
+#include <llvm/Support/raw_ostream.h>
 
+#include <map>
+#include <set>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -34,17 +37,54 @@
 namespace c2ffi {
     typedef std::vector<std::string> IncludeVector;
 
+    // Path to file contents
+    typedef std::map<std::string, std::string> BufferMap;
+
     struct config {
         IncludeVector includes;
         IncludeVector sys_includes;
+        IncludeVector inputs;
+        IncludeVector module_maps;
+
+        // --symbols and --symbol-regex: the only decls to write, if any
+        // are given, or with --reachable where to start from
+        std::set<std::string> symbols;
+        IncludeVector symbol_regex;
+
+        // --only-from: paths or globs for the files decls may come from
+        IncludeVector only_from;
+
+        // --exclude-namespace: globs for the qualified names of namespaces
+        // not to write
+        IncludeVector exclude_ns;
         OutputDriver *od = NULL;
+        const OutputDriverField *driver = NULL;
+        DeclVisitor *visitor = NULL;
+
+        // Files read from here instead of disk; owned by the caller
+        const BufferMap *overlay = NULL;
 
         std::ostream  *output = NULL;
         std::ofstream *macro_output = NULL;
         std::ofstream *template_output = NULL;
+        std::string macro_file;
+        std::string template_file;
+
+        // Where clang diagnostics and c2ffi warnings go; llvm::errs() if NULL
+        llvm::raw_ostream *diagnostics = NULL;
 
         std::string c2ffi_binpath;
         std::string filename;
+        std::string output_file;
+        std::string output_dir;
+        std::string serve_path;
+        std::string prelude;
+        std::string prefix_header;
+        std::string pch;
+        std::string module_cache;
+        std::string cache_dir;
+        std::string stat_cache;
+        std::string depfile;
         std::string to_namespace;
 
         clang::InputKind kind;
@@ -58,13 +98,40 @@ namespace c2ffi {
         bool fail_on_error = false;
         bool warn_as_error = false;
         bool nostdinc = false;
+        bool serve_fork = false;
+        bool auto_pch = false;
+        bool modules = false;
+        bool md = false;   // --MD: a depfile next to each output
+        bool watch = false;
+        bool cache_preprocessed = false;
+        bool fast_parse = false;
+        bool stop_early = false;    // once all of --symbols are written
+        bool reachable = false;
+        bool keep_used_records = false;
 
         int wchar_size = 0;
 
         int error_limit = -1;
+
+        int jobs = 1;
+
+        bool help = false;
+
+        llvm::raw_ostream& diag() const {
+            return diagnostics ? *diagnostics : llvm::errs();
+        }
     };
 
-    void process_args(config &config, int argc, char *argv[]);
+    /* Returns false if the arguments are invalid, after reporting the
+       problem to config.diag().  This uses getopt, so calls from different
+       threads are serialized.  IN_LIBRARY is for libc2ffi, which sets
+       config.driver itself, passes the input last and returns the output:
+       -o, -D and any other input are then errors. */
+    bool process_args(config &config, int argc, char *argv[],
+                      bool in_library = false);
+
+    /* Output file for INPUT when processing several inputs at once */
+    std::string batch_output_path(const config &config, const std::string &input);
 }
 
 #endif /* C2FFI_OPT_H */
@@ -0,0 +1,62 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_PCH_H
+#define C2FFI_PCH_H
+
+#include <string>
+
+#include "c2ffi/opt.h"
+
+namespace c2ffi {
+    /* Build PCH from HEADER if it doesn't exist, was built with different
+       options, or is older than a file the header includes.  The files
+       are listed in PCH + ".deps".  If c.pch is set, the new PCH is
+       chained onto it.  This is safe to call from several threads or
+       processes at once.  Returns false after reporting to c.diag() if
+       the build failed.  If it was built and UNGUARDED is given, that
+       gets the line of HEADER's first #include of a header without an
+       include guard or #pragma once, and 0 otherwise. */
+    bool update_pch(const config &c, const std::string &header,
+                    const std::string &pch, unsigned *unguarded = NULL);
+
+    /* PCH with a hash of the options update_pch(C, HEADER, ...) builds
+       with added, so that callers with different options each get their
+       own PCH instead of rebuilding a shared one under each other */
+    std::string keyed_pch(const config &c, const std::string &header,
+                          const std::string &pch);
+
+    /* Build PCH from HEADER unconditionally */
+    bool build_pch(const config &c, const std::string &header,
+                   const std::string &pch, unsigned *unguarded = NULL);
+
+    /* The #include <...> lines that every one of INPUTS starts with */
+    IncludeVector common_includes(const IncludeVector &inputs);
+
+    /* Precompile the common_includes() of c.inputs into c.output_dir,
+       up to the first one that isn't include-guarded, chained onto the
+       --prefix-header or --pch PCH if there is one, and set up c to load
+       it instead.  Does nothing if there's nothing in common.  Returns
+       false if the PCH couldn't be built. */
+    bool use_auto_pch(config &c);
+}
+
+#endif /* C2FFI_PCH_H */
@@ -50,5 +50,7 @@ namespace c2ffi {
     class ObjCInterfaceDecl;
     class ObjCCategoryDecl;
     class ObjCProtocolDecl;
+
+    class DeclVisitor;
 }
 #endif /* C2FFI_PREDECL_H */
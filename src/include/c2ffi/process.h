@@ -0,0 +1,45 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_PROCESS_H
+#define C2FFI_PROCESS_H
+
+#include <clang/Frontend/ASTUnit.h>
+
+#include "c2ffi/opt.h"
+#include "c2ffi/init.h"
+
+namespace c2ffi {
+    /* Parse config.filename and write it with config.od.  Returns the
+       exit status for the run. */
+    int process_file(config &config, session *s = NULL);
+
+    /* Write the decls of an already parsed or loaded unit with config.od,
+       as process_file() would have.  The unit's diagnostic client must
+       have had BeginSourceFile() called. */
+    int process_unit(config &config, clang::ASTUnit &unit);
+
+    /* Process every one of config.inputs into config.output_dir, using
+       config.jobs threads. */
+    int process_batch(config &config);
+}
+
+#endif /* C2FFI_PROCESS_H */
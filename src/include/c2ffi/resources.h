@@ -0,0 +1,47 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_RESOURCES_H
+#define C2FFI_RESOURCES_H
+
+#include <string>
+
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+namespace c2ffi {
+    /* The clang resource directory, which has the builtin headers
+       (stddef.h, the intrinsics, ...) under include/.  When c2ffi is built
+       with EMBED_RESOURCE_HEADERS, it only exists in file_system(). */
+    const char *resource_dir();
+
+    /* Whether PATH is one of the embedded resource headers.  These aren't
+       on disk and only change along with c2ffi itself, so they're left
+       out of dependency lists. */
+    bool is_embedded(const std::string &path);
+
+    /* The file system to parse from: the real one, with the embedded
+       resource headers in front of it if there are any.  It's built on
+       the first call and shared after that. */
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> file_system();
+}
+
+#endif /* C2FFI_RESOURCES_H */
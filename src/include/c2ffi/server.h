@@ -0,0 +1,45 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_SERVER_H
+#define C2FFI_SERVER_H
+
+#include "c2ffi/opt.h"
+
+namespace c2ffi {
+    /* Listen on the unix socket config.serve_path and answer parse
+       requests until killed.  Returns nonzero if the socket couldn't be
+       set up.
+
+       Every frame is a one-byte type, a 4-byte big-endian length, and
+       that many bytes of payload.  A request is an 'R' frame holding the
+       arguments c2ffi would be run with, each terminated by a NUL.  The
+       reply is any number of 'O' (output) and 'E' (diagnostics) frames,
+       sent as they are produced, then an 'S' frame with the exit status
+       in decimal.  A connection may make any number of requests, one
+       after another; connections are served concurrently, by threads or
+       with config.serve_fork by forked processes.  A child that crashes
+       has its request finished with an 'E' frame and an 'S' frame of 128
+       plus the signal number. */
+    int serve(config &config);
+}
+
+#endif /* C2FFI_SERVER_H */
@@ -0,0 +1,91 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_STATCACHE_H
+#define C2FFI_STATCACHE_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <clang/Basic/FileSystemStatCache.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include "c2ffi/opt.h"
+
+namespace c2ffi {
+    /* --stat-cache: the files header search found missing, by directory,
+       kept from one run to the next.  A directory's entries are only used
+       while its mtime is what it was when they were recorded, which costs
+       one stat() per directory instead of one per lookup in it.  Files
+       that do exist are always looked up, since changing one doesn't
+       change its directory. */
+    class StatCache {
+        struct dir {
+            int64_t mtime = 0;
+            bool stable = false;
+            std::set<std::string> missing;
+        };
+
+        std::string _path;
+        std::mutex _lock;
+        std::map<std::string, dir> _dirs;
+        bool _dirty;
+        std::atomic<unsigned> _run;
+
+        explicit StatCache(const std::string &path);
+
+    public:
+        /* The cache for PATH, loaded on first use and then shared by every
+           FileManager in the process.  With an empty PATH, it is only
+           kept in memory. */
+        static std::shared_ptr<StatCache> get(const std::string &path);
+
+        /* Start a new run: FileManagers already using the cache check
+           each directory again before trusting it */
+        void new_run() { _run++; }
+        unsigned run() const { return _run; }
+
+        /* Check DIR against the file system, forgetting what was recorded
+           for it if it changed */
+        void validate(const std::string &dir, llvm::vfs::FileSystem &fs);
+        bool is_missing(const std::string &dir, const std::string &name);
+        void add_missing(const std::string &dir, const std::string &name);
+
+        /* For a FileManager's setStatCache() */
+        std::unique_ptr<clang::FileSystemStatCache> make_fs_cache();
+
+        /* Write the cache back if anything was added.  Failing isn't
+           reported; the next run just has to look again. */
+        void save();
+    };
+
+    /* Starts a new run of c.stat_cache, if it's set */
+    void new_stat_cache_run(const config &c);
+
+    /* Saves c.stat_cache, if it's set */
+    void save_stat_cache(const config &c);
+}
+
+#endif /* C2FFI_STATCACHE_H */
@@ -0,0 +1,57 @@
+/*  -*- c++ -*-
+
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef C2FFI_VISITOR_H
+#define C2FFI_VISITOR_H
+
+#include <string>
+
+#include <clang/AST/DeclBase.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "c2ffi.h"
+#include "c2ffi/opt.h"
+
+namespace c2ffi {
+    /**
+       For embedding c2ffi: receives each top-level declaration as it is
+       converted, in the same order an OutputDriver would write them.
+
+       Both d and the clang::Decl it was made from are only valid for the
+       duration of the call; copy out whatever is needed.  Use
+       d.write(driver) to serialize it anyway.
+     **/
+    class DeclVisitor {
+    public:
+        virtual ~DeclVisitor() { }
+        virtual void visit(const Decl &d, const clang::Decl *cd) = 0;
+    };
+
+    /* Parse FILENAME with the c2ffi command line options in ARGS, and
+       pass each declaration to V instead of an output driver.  Files in
+       OVERLAY are read from there instead of disk.  Returns the exit
+       status c2ffi would have. */
+    int visit_file(const std::string &filename, const IncludeVector &args,
+                   DeclVisitor &v, llvm::raw_ostream *diagnostics = NULL,
+                   const BufferMap *overlay = NULL);
+}
+
+#endif /* C2FFI_VISITOR_H */
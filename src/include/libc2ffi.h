@@ -0,0 +1,76 @@
+/* -*- c -*-
+
+   c2ffi
+   Copyright (C) 2013  Ryan Pavlik
+
+   This file is part of c2ffi.
+
+   c2ffi is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   c2ffi is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBC2FFI_H
+#define LIBC2FFI_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct c2ffi_result c2ffi_result;
+
+    /**
+       c2ffi_parse() - Parse FILENAME in-process and return its output.
+
+       DRIVER names an output driver ("json", "sexp", ...); NULL selects
+       the default.  ARGV holds ARGC further command line options, as
+       given to the c2ffi executable (e.g. "-I", "include", "--std=c99"),
+       without input files, -o or -D, which are errors.  A -M or -T file is
+       still written to disk.
+
+       This never returns NULL; check c2ffi_result_status().  Parses may
+       run concurrently from several threads.
+     **/
+    c2ffi_result* c2ffi_parse(const char *filename, const char *driver,
+                              int argc, const char *const *argv);
+
+    /**
+       c2ffi_parse_buffers() - c2ffi_parse(), with NBUFFERS files read
+       from memory instead of disk.  PATHS[i] holds the SIZES[i] bytes at
+       CONTENTS[i]; relative paths are taken from the current directory.
+       FILENAME may be one of them, and they may include each other and
+       files on disk.  The buffers are copied, so they only need to last
+       for the call.
+     **/
+    c2ffi_result* c2ffi_parse_buffers(const char *filename, const char *driver,
+                                      int argc, const char *const *argv,
+                                      int nbuffers, const char *const *paths,
+                                      const char *const *contents,
+                                      const size_t *sizes);
+
+    /* 0 on success, as for the exit status of c2ffi */
+    int c2ffi_result_status(const c2ffi_result *r);
+
+    /* The output of the driver, and any errors and warnings.  The
+       buffers are NUL-terminated and live as long as R. */
+    const char* c2ffi_result_output(const c2ffi_result *r, size_t *size);
+    const char* c2ffi_result_diagnostics(const c2ffi_result *r, size_t *size);
+
+    void c2ffi_result_free(c2ffi_result *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBC2FFI_H */
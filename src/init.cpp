@@ -18,12 +18,16 @@
   along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstring>
 #include <iostream>
 #include <memory>
 
 #include <llvm/Support/Host.h>
 #include <llvm/ADT/IntrusiveRefCntPtr.h>
 #include <llvm/Option/Option.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
 
 #include <clang/Driver/Driver.h>
 #include <clang/Driver/Compilation.h>
@@ -46,61 +50,98 @@
 #include <clang/AST/ASTConsumer.h>
 #include <clang/Parse/Parser.h>
 #include <clang/Parse/ParseAST.h>
+#include <clang/Serialization/PCHContainerOperations.h>
 
-#include <sys/stat.h>
-
+#include "c2ffi/cache.h"
 #include "c2ffi/init.h"
 #include "c2ffi/opt.h"
+#include "c2ffi/resources.h"
+#include "c2ffi/statcache.h"
 
 using namespace c2ffi;
 
-void c2ffi::add_include(clang::CompilerInstance &ci, const char *path, bool is_angled,
+bool c2ffi::add_include(clang::CompilerInstance &ci, const char *path, bool is_angled,
                         bool show_error) {
-    struct stat buf{};
-    if(stat(path, &buf) < 0 || !S_ISDIR(buf.st_mode)) {
+    // Through the file manager, so directories only in an overlay count
+    // and --stat-cache sees the lookup
+    auto dirent = ci.getFileManager().getDirectoryRef(path);
+    if(!dirent) {
+        llvm::consumeError(dirent.takeError());
+
         if(show_error) {
-            std::cerr << "Error: Not a directory: ";
-            if(is_angled)
-                std::cerr << "-i ";
-            else
-                std::cerr << "-I ";
-
-            std::cerr << path << std::endl;
-            exit(1);
+            clang::DiagnosticsEngine &diags = ci.getDiagnostics();
+            unsigned id = diags.getCustomDiagID(clang::DiagnosticsEngine::Error,
+                                                "not a directory: %0 %1");
+            diags.Report(id) << (is_angled ? "-i" : "-I") << path;
+            return false;
         }
 
-        return;
+        return true;
     }
 
-    auto &fm = ci.getFileManager();
-    if (auto dirent = fm.getDirectoryRef(path); dirent) {
-        clang::DirectoryLookup lookup(*dirent, clang::SrcMgr::C_System, false);
+    clang::DirectoryLookup lookup(*dirent, clang::SrcMgr::C_System, false);
+    ci.getPreprocessor().getHeaderSearchInfo()
+        .AddSearchPath(lookup, is_angled);
 
-        ci.getPreprocessor().getHeaderSearchInfo()
-            .AddSearchPath(lookup, is_angled);
-    }
+    return true;
 }
 
-void c2ffi::add_includes(clang::CompilerInstance &ci,
+bool c2ffi::add_includes(clang::CompilerInstance &ci,
                          c2ffi::IncludeVector &includeVector, bool is_angled,
                          bool show_error) {
-    for(auto &&include : includeVector)
-        add_include(ci, include.c_str(), is_angled, show_error);
+    for(auto &&include : includeVector) {
+        if(!add_include(ci, include.c_str(), is_angled, show_error))
+            return false;
+    }
+
+    return true;
 }
 
-void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
+// An invocation from cc1 ARGS as make_invocation() keeps them: each
+// followed by a NUL, and without the ones naming the input
+static std::shared_ptr<clang::CompilerInvocation> parse_arguments(config &c,
+                                                                  const std::string &args) {
+    std::vector<const char *> cargs;
+    for(size_t i = 0; i < args.size(); i += strlen(&args[i]) + 1)
+        cargs.push_back(&args[i]);
+
+    std::string main_file = llvm::sys::path::filename(c.filename).str();
+    cargs.push_back("-main-file-name");
+    cargs.push_back(main_file.c_str());
+    cargs.push_back(c.filename.c_str());
+
+    clang::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts = new clang::DiagnosticOptions();
+    clang::TextDiagnosticPrinter *tpd =
+        new clang::TextDiagnosticPrinter(c.diag(), &*DiagOpts, false);
+    clang::IntrusiveRefCntPtr<clang::DiagnosticIDs> DiagID(
+        new clang::DiagnosticIDs());
+    clang::DiagnosticsEngine Diags(DiagID, &*DiagOpts, tpd);
+
+    auto cinv = std::make_shared<clang::CompilerInvocation>();
+    if (!clang::CompilerInvocation::CreateFromArgs(*cinv, cargs, Diags))
+        return nullptr;
+
+    if (c.nostdinc) {
+        // setting -nostdinc isn't sufficient for some reason, this erases all
+        // the search paths that were added previously.
+        cinv->getHeaderSearchOpts().UserEntries.clear();
+    }
+
+    return cinv;
+}
+
+// ARGS, if given, gets the cc1 arguments, less the ones naming the input
+static std::shared_ptr<clang::CompilerInvocation> make_invocation(config &c,
+                                                                  std::string *args = NULL) {
     using clang::DiagnosticOptions;
     using clang::TextDiagnosticPrinter;
-    using clang::TargetOptions;
-    using clang::TargetInfo;
     using clang::IntrusiveRefCntPtr;
-    using clang::CompilerInvocation;
 
     std::vector<const char *> cargs;
     cargs.push_back(c.c2ffi_binpath.c_str());
     cargs.push_back("-fsyntax-only");
     cargs.push_back("-resource-dir");
-    cargs.push_back(CLANG_RESOURCE_DIRECTORY);
+    cargs.push_back(resource_dir());
     if (c.nostdinc) {
         cargs.push_back("-nostdinc");
     }
@@ -108,11 +149,23 @@ void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
         cargs.push_back("-x");
         cargs.push_back(c.lang.c_str());
     }
+
+    std::vector<std::string> module_args;
+    if (c.modules) {
+        module_args.push_back("-fmodules");
+        if (!c.module_cache.empty())
+            module_args.push_back("-fmodules-cache-path=" + c.module_cache);
+        for (auto &&map : c.module_maps)
+            module_args.push_back("-fmodule-map-file=" + map);
+    }
+    for (auto &&arg : module_args)
+        cargs.push_back(arg.c_str());
+
     cargs.push_back(c.filename.c_str());
 
     IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
     TextDiagnosticPrinter *tpd =
-        new TextDiagnosticPrinter(llvm::errs(), &*DiagOpts, false);
+        new TextDiagnosticPrinter(c.diag(), &*DiagOpts, false);
     IntrusiveRefCntPtr<clang::DiagnosticIDs> DiagID(
         new clang::DiagnosticIDs());
     clang::DiagnosticsEngine Diags(DiagID, &*DiagOpts, tpd);
@@ -123,34 +176,128 @@ void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
     Driver.setCheckInputsExist(false);
 
     std::unique_ptr<clang::driver::Compilation> C(Driver.BuildCompilation(cargs));
+    if (!C || Diags.hasErrorOccurred())
+        return nullptr;
+
     const clang::driver::JobList &Jobs = C->getJobs();
     if (Jobs.size() != 1) {
         Diags.Report(clang::diag::err_fe_expected_compiler_job);
-        exit(1);
+        return nullptr;
     }
 
     const clang::driver::Command &Cmd = clang::cast<clang::driver::Command>(*Jobs.begin());
     if (llvm::StringRef(Cmd.getCreator().getName()) != "clang") {
         Diags.Report(clang::diag::err_fe_expected_clang_command);
-        exit(1);
+        return nullptr;
     }
 
-    static std::unique_ptr<clang::CompilerInvocation> cinv;
-    cinv = std::make_unique<CompilerInvocation>();
-    CompilerInvocation::CreateFromArgs(*cinv, Cmd.getArguments(), Diags);
-    if (c.nostdinc) {
-        // setting -nostdinc isn't sufficient for some reason, this erases all
-        // the search paths that were added previously.
-        cinv->getHeaderSearchOpts().UserEntries.clear();
+    std::string cc1_args;
+    const auto &cc1 = Cmd.getArguments();
+    for (size_t i = 0; i < cc1.size(); i++) {
+        if (llvm::StringRef(cc1[i]) == "-main-file-name")
+            i++;
+        else if (c.filename != cc1[i])
+            cc1_args += std::string(cc1[i]) + '\0';
     }
 
-    ci.setInvocation(std::move(cinv));
+    if (args)
+        *args = cc1_args;
+    return parse_arguments(c, cc1_args);
+}
+
+// Inputs whose extensions map to the same language share an invocation;
+// an explicit -x applies to every input.  Everything else make_invocation()
+// passes to the driver is part of the key too, since a session may see
+// differing configs.
+static std::string invocation_key(const config &c) {
+    std::string key = c.arch + '\0' + (c.nostdinc ? "nostdinc" : "") + '\0';
+
+    if(c.modules) {
+        key += "modules " + c.module_cache + '\0';
+        for(auto &&map : c.module_maps)
+            key += map + '\0';
+    }
+
+    if(!c.lang.empty())
+        return key + "-x " + c.lang;
+
+    llvm::StringRef ext = llvm::sys::path::extension(c.filename);
+    auto lang = clang::FrontendOptions::getInputKindForExtension(ext.ltrim('.')).getLanguage();
+    return key + std::to_string((int)lang);
+}
+
+// Running the driver means toolchain detection, which is slow, so
+// derive the invocation once and only swap in the input file.  With
+// --cache-dir, the arguments outlive the session too.
+static std::shared_ptr<clang::CompilerInvocation>& cached_invocation(config &c, session &s) {
+    std::string key = invocation_key(c);
+    auto &cached = s.invocations[key];
+
+    if(!cached) {
+        std::string &args = s.arguments[key];
+        args.clear();
+        if(load_arguments(c, key, args))
+            cached = parse_arguments(c, args);
+
+        if(!cached) {
+            args.clear();
+            cached = make_invocation(c, &args);
+            if(cached)
+                store_arguments(c, key, args);
+        }
+    }
+
+    return cached;
+}
+
+std::string c2ffi::get_arguments(config &c, session &s) {
+    if(!cached_invocation(c, s))
+        return "";
+
+    return s.arguments[invocation_key(c)];
+}
+
+std::shared_ptr<clang::CompilerInvocation> c2ffi::get_invocation(config &c, session &s) {
+    auto &cached = cached_invocation(c, s);
+    if(!cached)
+        return nullptr;
+
+    auto cinv = std::make_shared<clang::CompilerInvocation>(*cached);
+    auto &inputs = cinv->getFrontendOpts().Inputs;
+    if(inputs.size() == 1) {
+        clang::InputKind kind = inputs[0].getKind();
+        inputs.clear();
+        inputs.emplace_back(c.filename, kind);
+    }
+
+    return cinv;
+}
+
+// c.overlay's files, in front of the real ones
+static llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> overlay_fs(const config &c) {
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> real = file_system();
+    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> fs =
+        new llvm::vfs::OverlayFileSystem(real);
+    llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> mem =
+        new llvm::vfs::InMemoryFileSystem;
+
+    // Relative paths are relative to where c2ffi runs, as they'd be on disk
+    if(auto cwd = real->getCurrentWorkingDirectory())
+        mem->setCurrentWorkingDirectory(*cwd);
+
+    for(auto &&file : *c.overlay)
+        mem->addFile(file.first, 0, llvm::MemoryBuffer::getMemBufferCopy(file.second, file.first));
 
-    // Extract the language that was inferred or specified for the input file.
-    auto &fInputs = ci.getInvocation().getFrontendOpts().Inputs;
+    fs->pushOverlay(mem);
+    return fs;
+}
+
+// Extract the language that was inferred or specified for the input file.
+static bool check_input(config &c, clang::CompilerInvocation &cinv) {
+    auto &fInputs = cinv.getFrontendOpts().Inputs;
     if (fInputs.size() != 1) {
-        std::cout << "Error: No input files from frontend" << std::endl;
-        exit(1);
+        c.diag() << "Error: No input files from frontend\n";
+        return false;
     } else {
         c.kind = fInputs[0].getKind();
         switch (c.kind.getLanguage()) {
@@ -160,24 +307,19 @@ void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
         case clang::Language::ObjCXX:
             break;
         default:
-            std::cerr << "Error: Language " << (c.lang.empty() ? "of file " + c.filename : c.lang)
-                      << " not supported." << std::endl;
-            exit(1);
+            c.diag() << "Error: Language " << (c.lang.empty() ? "of file " + c.filename : c.lang)
+                     << " not supported.\n";
+            return false;
         }
     }
 
-    // Create the compilers actual diagnostics engine.
-    ci.createDiagnostics();
-    ci.getDiagnostics().setWarningsAsErrors(c.warn_as_error);
-    if (c.error_limit >= 0)
-      ci.getDiagnostics().setErrorLimit(c.error_limit);
-
-    TargetInfo *pti = TargetInfo::CreateTargetInfo(
-        ci.getDiagnostics(), ci.getInvocation().TargetOpts);
-    ci.setTarget(pti);
+    return true;
+}
 
-    clang::LangOptions &lo = ci.getLangOpts();
-    switch(pti->getTriple().getEnvironment()) {
+static void set_lang_options(config &c, clang::CompilerInvocation &cinv,
+                             const llvm::Triple &triple) {
+    clang::LangOptions &lo = cinv.getLangOpts();
+    switch(triple.getEnvironment()) {
         case llvm::Triple::EnvironmentType::GNU:
             lo.GNUMode = 1;
             break;
@@ -186,10 +328,10 @@ void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
             lo.MicrosoftExt = 1;
             break;
         default:
-            std::cerr << "c2ffi warning: Unhandled environment: '"
-                      << pti->getTriple().getEnvironmentName().str()
-                      << "' for triple '" << c.arch
-                      << "'" << std::endl;
+            c.diag() << "c2ffi warning: Unhandled environment: '"
+                     << triple.getEnvironmentName()
+                     << "' for triple '" << c.arch
+                     << "'\n";
     }
 
     if(c.declspec)
@@ -199,20 +341,175 @@ void c2ffi::init_ci(config &c, clang::CompilerInstance &ci) {
         lo.WCharSize = c.wchar_size;
 
     clang::PreprocessorOptions preopts;
-    ci.getInvocation().setLangDefaults(lo, c.kind, pti->getTriple(), preopts, c.std);
-    ci.createFileManager();
+    cinv.setLangDefaults(lo, c.kind, triple, preopts, c.std);
+
+    // --fast-parse: nothing c2ffi writes comes from inside a function, so
+    // the bodies needn't be parsed.  Clang still parses those it may need
+    // to evaluate (constexpr, deduced return types).  Delaying template
+    // bodies until they're instantiated also changes how names in them
+    // are looked up, so it's left alone when -T writes instantiations.
+    if(c.fast_parse) {
+        cinv.getFrontendOpts().SkipFunctionBodies = true;
+        if(lo.CPlusPlus && !c.template_output)
+            lo.DelayedTemplateParsing = 1;
+    }
+}
+
+bool c2ffi::init_ci(config &c, clang::CompilerInstance &ci, session *s,
+                    clang::TranslationUnitKind tu) {
+    using clang::TargetOptions;
+    using clang::TargetInfo;
+
+    auto cinv = s ? get_invocation(c, *s) : make_invocation(c);
+    if(!cinv || !check_input(c, *cinv))
+        return false;
+
+    ci.setInvocation(std::move(cinv));
+
+    // Create the compilers actual diagnostics engine.
+    ci.createDiagnostics(
+        new clang::TextDiagnosticPrinter(c.diag(), &ci.getDiagnosticOpts()));
+    ci.getDiagnostics().setWarningsAsErrors(c.warn_as_error);
+    ci.getDiagnostics().setIgnoreAllWarnings(c.fast_parse && !c.warn_as_error);
+    if (c.error_limit >= 0)
+      ci.getDiagnostics().setErrorLimit(c.error_limit);
+
+    TargetInfo *pti = TargetInfo::CreateTargetInfo(
+        ci.getDiagnostics(), ci.getInvocation().TargetOpts);
+    if(!pti)
+        return false;
+    ci.setTarget(pti);
+    set_lang_options(c, ci.getInvocation(), pti->getTriple());
+
+    if(c.overlay) {
+        // Not shared, as the overlay belongs to this config
+        ci.createFileManager(overlay_fs(c));
+    } else if(s && s->fm) {
+        ci.setFileManager(s->fm.get());
+    } else {
+        std::shared_ptr<StatCache> cache = !c.stat_cache.empty() ? StatCache::get(c.stat_cache)
+                                           : s ? s->stat_cache : nullptr;
+
+        ci.createFileManager(file_system());
+        if(cache)
+            ci.getFileManager().setStatCache(cache->make_fs_cache());
+        if(s)
+            s->fm = &ci.getFileManager();
+    }
     ci.createSourceManager(ci.getFileManager());
 
     // examples/clang-interpreter/main.cpp
     // Infer the builtin include path if unspecified.
     clang::HeaderSearchOptions &hso = ci.getHeaderSearchOpts();
     if (!c.nostdinc && hso.ResourceDir.empty())
-        hso.ResourceDir = CLANG_RESOURCE_DIRECTORY;
-    ci.createPreprocessor(clang::TU_Complete);
+        hso.ResourceDir = resource_dir();
+
+    // As with clang -include-pch, the PCH stands in for including its
+    // prefix header.  There's no AST to load it into with -E, so that
+    // includes the header itself.
+    clang::PreprocessorOptions &ppo = ci.getPreprocessorOpts();
+    if(!c.preprocess_only)
+        ppo.ImplicitPCHInclude = c.pch;
+    else if(!c.prefix_header.empty())
+        ppo.Includes.push_back(c.prefix_header);
+
+    ci.createPreprocessor(tu);
     ci.getPreprocessorOpts().UsePredefines = false;
     ci.getPreprocessorOutputOpts().ShowCPP = c.preprocess_only;
     auto &PP = ci.getPreprocessor();
     PP.setPreprocessedOutput(c.preprocess_only);
     // FIXME this is normally called from FrontendAction. Perhaps we should use IndexAction?
     PP.getBuiltinInfo().initializeBuiltins(PP.getIdentifierTable(), PP.getLangOpts());
+    return true;
+}
+
+std::shared_ptr<clang::CompilerInvocation> c2ffi::get_unit_invocation(config &c, session &s) {
+    auto cinv = get_invocation(c, s);
+    if(!cinv || !check_input(c, *cinv))
+        return nullptr;
+
+    set_lang_options(c, *cinv, llvm::Triple(cinv->getTargetOpts().Triple));
+
+    clang::HeaderSearchOptions &hso = cinv->getHeaderSearchOpts();
+    if (!c.nostdinc && hso.ResourceDir.empty())
+        hso.ResourceDir = resource_dir();
+
+    // Checked as add_include() does, through a file manager on the same
+    // file system as the unit's
+    clang::FileManager fm(cinv->getFileSystemOpts(), file_system());
+
+    // The nearest groups to where add_include() puts them: -I for quoted
+    // includes only, -i ahead of the system directories
+    for(auto *v : { &c.includes, &c.sys_includes }) {
+        bool is_angled = (v == &c.sys_includes);
+
+        for(auto &&path : *v) {
+            auto dirent = fm.getDirectoryRef(path);
+            if(!dirent) {
+                llvm::consumeError(dirent.takeError());
+                c.diag() << "Error: not a directory: " << (is_angled ? "-i " : "-I ")
+                         << path << "\n";
+                return nullptr;
+            }
+
+            hso.AddPath(path, is_angled ? clang::frontend::Angled : clang::frontend::Quoted,
+                        false, true);
+        }
+    }
+
+    cinv->getPreprocessorOpts().ImplicitPCHInclude = c.pch;
+
+    // The unit resets its diagnostics from these on every parse
+    if(c.warn_as_error)
+        cinv->getDiagnosticOpts().Warnings.push_back("error");
+    else if(c.fast_parse)
+        cinv->getDiagnosticOpts().IgnoreWarnings = true;
+    if(c.error_limit >= 0)
+        cinv->getDiagnosticOpts().ErrorLimit = c.error_limit;
+
+    return cinv;
+}
+
+bool c2ffi::is_ast_file(const config &c) {
+    llvm::StringRef ext = llvm::sys::path::extension(c.filename);
+    return ext == ".ast" || ext == ".pch";
+}
+
+std::unique_ptr<clang::ASTUnit> c2ffi::load_ast(config &c) {
+    // The unit's reader keeps a reference to this
+    static const clang::RawPCHContainerReader reader;
+
+    // The reader can report problems before there are any LangOptions
+    static const clang::LangOptions no_lang;
+
+    clang::IntrusiveRefCntPtr<clang::DiagnosticOptions> opts = new clang::DiagnosticOptions();
+    auto *printer = new clang::TextDiagnosticPrinter(c.diag(), opts.get());
+    auto diags = clang::CompilerInstance::createDiagnostics(opts.get(), printer);
+    diags->setWarningsAsErrors(c.warn_as_error);
+    if (c.error_limit >= 0)
+        diags->setErrorLimit(c.error_limit);
+    printer->BeginSourceFile(no_lang);
+
+    auto unit = clang::ASTUnit::LoadFromASTFile(c.filename, reader,
+                                                clang::ASTUnit::LoadEverything,
+                                                diags, clang::FileSystemOptions());
+    if(!unit) {
+        c.diag() << "Error: Could not load AST file: " << c.filename << "\n";
+        return nullptr;
+    }
+
+    printer->BeginSourceFile(unit->getLangOpts(), &unit->getPreprocessor());
+    return unit;
+}
+
+void c2ffi::init_ci_from(config &c, clang::CompilerInstance &ci, clang::ASTUnit &unit) {
+    clang::ASTContext &ctx = unit.getASTContext();
+
+    ci.setDiagnostics(&unit.getDiagnostics());
+    ci.getLangOpts() = unit.getLangOpts();
+    ci.setTarget(const_cast<clang::TargetInfo*>(&ctx.getTargetInfo()));
+    ci.setFileManager(&unit.getFileManager());
+    ci.setSourceManager(&unit.getSourceManager());
+    ci.setPreprocessor(unit.getPreprocessorPtr());
+    ci.setASTContext(&ctx);
 }
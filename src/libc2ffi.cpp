@@ -0,0 +1,170 @@
+/*
+  c2ffi
+  Copyright (C) 2013  Ryan Pavlik
+
+  This file is part of c2ffi.
+
+  c2ffi is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  c2ffi is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include "c2ffi.h"
+#include "c2ffi/opt.h"
+#include "c2ffi/process.h"
+#include "c2ffi/visitor.h"
+#include "libc2ffi.h"
+
+using namespace c2ffi;
+
+struct c2ffi_result {
+    int status = 1;
+    std::string output;
+    std::string diagnostics;
+};
+
+// Fill in SYS as the c2ffi executable would for this command line
+static bool parse_args(config &sys, const char *filename, const char *driver,
+                       const IncludeVector &options) {
+    // getopt may permute argv, so give it a copy it can own
+    std::vector<std::string> args;
+    args.push_back("c2ffi");
+    args.insert(args.end(), options.begin(), options.end());
+    args.push_back(filename);
+
+    for(OutputDriverField *f = OutputDrivers; driver && f->name; f++) {
+        if(!strcmp(f->name, driver))
+            sys.driver = f;
+    }
+
+    if(driver && !sys.driver) {
+        sys.diag() << "Error: Invalid output driver: " << driver << "\n";
+        return false;
+    }
+
+    std::vector<char*> cargs;
+    for(auto &&arg : args)
+        cargs.push_back(&arg[0]);
+    cargs.push_back(NULL);
+
+    if(!process_args(sys, (int)args.size(), cargs.data(), true))
+        return false;
+
+    if(sys.help || !sys.od || sys.watch) {
+        sys.diag() << "Error: --help, --output-dir, --serve and --watch can't be used here\n";
+        return false;
+    }
+
+    return true;
+}
+
+static c2ffi_result* parse(const char *filename, const char *driver,
+                           int argc, const char *const *argv,
+                           const BufferMap *overlay) {
+    c2ffi_result *r = new c2ffi_result;
+    llvm::raw_string_ostream diag(r->diagnostics);
+    std::ostringstream out;
+    config sys;
+
+    sys.diagnostics = &diag;
+    sys.overlay = overlay;
+
+    bool ok = parse_args(sys, filename, driver, IncludeVector(argv, argv + argc));
+    std::unique_ptr<OutputDriver> od(sys.od);
+
+    if(ok) {
+        od->set_os(&out);
+        sys.output = &out;
+        r->status = process_file(sys);
+    }
+
+    delete sys.macro_output;
+    delete sys.template_output;
+
+    diag.flush();
+    r->output = out.str();
+    return r;
+}
+
+c2ffi_result* c2ffi_parse(const char *filename, const char *driver,
+                          int argc, const char *const *argv) {
+    return parse(filename, driver, argc, argv, NULL);
+}
+
+c2ffi_result* c2ffi_parse_buffers(const char *filename, const char *driver,
+                                  int argc, const char *const *argv,
+                                  int nbuffers, const char *const *paths,
+                                  const char *const *contents, const size_t *sizes) {
+    BufferMap overlay;
+
+    for(int i = 0; i < nbuffers; i++)
+        overlay[paths[i]].assign(contents[i], sizes[i]);
+
+    return parse(filename, driver, argc, argv, &overlay);
+}
+
+int c2ffi::visit_file(const std::string &filename, const IncludeVector &args,
+                      DeclVisitor &v, llvm::raw_ostream *diagnostics,
+                      const BufferMap *overlay) {
+    config sys;
+    int result = 1;
+
+    sys.diagnostics = diagnostics;
+    sys.overlay = overlay;
+
+    bool ok = parse_args(sys, filename.c_str(), NULL, args);
+
+    // Only the visitor sees the declarations; nothing is serialized
+    delete sys.od;
+    sys.od = NULL;
+
+    if(!ok) {
+        // already reported
+    } else if(sys.preprocess_only) {
+        sys.diag() << "Error: -E can't be used with a DeclVisitor\n";
+    } else {
+        sys.output = NULL;
+        sys.visitor = &v;
+        result = process_file(sys);
+    }
+
+    delete sys.macro_output;
+    delete sys.template_output;
+
+    return result;
+}
+
+int c2ffi_result_status(const c2ffi_result *r) {
+    return r->status;
+}
+
+const char* c2ffi_result_output(const c2ffi_result *r, size_t *size) {
+    if(size) *size = r->output.size();
+    return r->output.c_str();
+}
+
+const char* c2ffi_result_diagnostics(const c2ffi_result *r, size_t *size) {
+    if(size) *size = r->diagnostics.size();
+    return r->diagnostics.c_str();
+}
+
+void c2ffi_result_free(c2ffi_result *r) {
+    delete r;
+}
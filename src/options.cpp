@@ -20,16 +20,25 @@
 */
 
 #include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include <getopt.h>
 #include <sys/stat.h>
 
+#include <llvm/Support/GlobPattern.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/Regex.h>
 
 #include "c2ffi.h"
 #include "c2ffi/opt.h"
 
-static char short_opt[] = "I:i:D:M:o:hN:x:A:T:E";
+// The leading ':' has getopt tell a missing argument from a bad option
+static char short_opt[] = ":I:i:D:M:o:hN:x:A:T:Ej:";
 
 enum {
     WITH_MACRO_DEFS = CHAR_MAX+1,
@@ -39,6 +48,31 @@ enum {
     NOSTDINC        = CHAR_MAX+5,
     WCHAR_SIZE      = CHAR_MAX+6,
     ERROR_LIMIT     = CHAR_MAX+7,
+    OUTPUT_DIR      = CHAR_MAX+8,
+    INPUT_LIST      = CHAR_MAX+9,
+    SERVE           = CHAR_MAX+10,
+    FORK            = CHAR_MAX+11,
+    PRELUDE         = CHAR_MAX+12,
+    PREFIX_HEADER   = CHAR_MAX+13,
+    PCH             = CHAR_MAX+14,
+    AUTO_PCH        = CHAR_MAX+15,
+    MODULES         = CHAR_MAX+16,
+    MODULE_CACHE    = CHAR_MAX+17,
+    MODULE_MAP      = CHAR_MAX+18,
+    CACHE_DIR       = CHAR_MAX+19,
+    DEPFILE         = CHAR_MAX+20,
+    MD              = CHAR_MAX+21,
+    WATCH           = CHAR_MAX+22,
+    STAT_CACHE      = CHAR_MAX+23,
+    CACHE_PREPROCESSED = CHAR_MAX+24,
+    FAST_PARSE      = CHAR_MAX+25,
+    SYMBOLS         = CHAR_MAX+26,
+    STOP_EARLY      = CHAR_MAX+27,
+    ONLY_FROM       = CHAR_MAX+28,
+    SYMBOL_REGEX    = CHAR_MAX+29,
+    REACHABLE       = CHAR_MAX+30,
+    EXCLUDE_NAMESPACE = CHAR_MAX+31,
+    KEEP_USED_RECORDS = CHAR_MAX+32,
 
     OPTION_MAX
 };
@@ -62,11 +96,38 @@ static struct option options[] = {
     { "nostdinc",        no_argument,   0, NOSTDINC        },
     { "wchar-size",  required_argument, 0, WCHAR_SIZE      },
     { "error-limit", required_argument, 0, ERROR_LIMIT     },
+    { "output-dir",  required_argument, 0, OUTPUT_DIR      },
+    { "input-list",  required_argument, 0, INPUT_LIST      },
+    { "jobs",        required_argument, 0, 'j'             },
+    { "serve",       required_argument, 0, SERVE           },
+    { "fork",            no_argument,   0, FORK            },
+    { "prelude",     required_argument, 0, PRELUDE         },
+    { "prefix-header", required_argument, 0, PREFIX_HEADER },
+    { "pch",         required_argument, 0, PCH             },
+    { "auto-pch",        no_argument,   0, AUTO_PCH        },
+    { "modules",         no_argument,   0, MODULES         },
+    { "module-cache", required_argument, 0, MODULE_CACHE   },
+    { "module-map",  required_argument, 0, MODULE_MAP      },
+    { "cache-dir",   required_argument, 0, CACHE_DIR       },
+    { "depfile",     required_argument, 0, DEPFILE         },
+    { "MD",              no_argument,   0, MD              },
+    { "watch",           no_argument,   0, WATCH           },
+    { "stat-cache",  required_argument, 0, STAT_CACHE      },
+    { "cache-preprocessed", no_argument, 0, CACHE_PREPROCESSED },
+    { "fast-parse",      no_argument,   0, FAST_PARSE      },
+    { "symbols",     required_argument, 0, SYMBOLS         },
+    { "stop-early",      no_argument,   0, STOP_EARLY      },
+    { "only-from",   required_argument, 0, ONLY_FROM       },
+    { "symbol-regex", required_argument, 0, SYMBOL_REGEX   },
+    { "reachable",       no_argument,   0, REACHABLE       },
+    { "exclude-namespace", required_argument, 0, EXCLUDE_NAMESPACE },
+    { "keep-used-records", no_argument, 0, KEEP_USED_RECORDS },
     { 0, 0, 0, 0 }
 };
 
 static void usage(void);
-static c2ffi::OutputDriver* select_driver(std::string name, std::ostream *os);
+static const c2ffi::OutputDriverField* select_driver(std::string name);
+static bool read_input_list(c2ffi::config &config, const char *path);
 
 clang::LangStandard::Kind parseStd(std::string std) {
 #define LANGSTANDARD(ident, name, lang, desc, features) if(std == name) return clang::LangStandard::lang_##ident;
@@ -74,12 +135,29 @@ clang::LangStandard::Kind parseStd(std::string std) {
     return clang::LangStandard::lang_unspecified;
 }
 
-void c2ffi::process_args(config &config, int argc, char *argv[]) {
+// getopt keeps its state in globals
+static std::mutex getopt_lock;
+
+// What getopt_long() returned '?' for: optopt is the short option, even
+// in a cluster like -qZ, or 0 for an unknown long one, which getopt has
+// already stepped past
+static std::string bad_option(char *argv[]) {
+    if(optopt > 0 && optopt <= CHAR_MAX)
+        return std::string("-") + (char)optopt;
+    return argv[optind - 1];
+}
+
+bool c2ffi::process_args(config &config, int argc, char *argv[], bool in_library) {
     int o, index;
     bool output_specified = false;
     std::ostream *os = &std::cout;
     config.c2ffi_binpath = argv[0];
 
+    // Reset getopt so this can be called more than once per process
+    std::lock_guard<std::mutex> guard(getopt_lock);
+    optind = 0;
+    opterr = 0;
+
     for(;;) {
         o = getopt_long(argc, argv, short_opt, options, &index);
 
@@ -87,32 +165,29 @@ void c2ffi::process_args(config &config, int argc, char *argv[]) {
             break;
 
         switch(o) {
-            case 'M': {
-                if(config.macro_output) {
-                    std::cerr << "Error: You may only specify one macro file"
-                              << std::endl;
-                    exit(1);
+            case 'M':
+                if(!config.macro_file.empty()) {
+                    config.diag() << "Error: You may only specify one macro file\n";
+                    return false;
                 }
 
-                std::ofstream *of = new std::ofstream;
-                of->open(optarg);
-                config.macro_output = of;
+                config.macro_file = optarg;
                 break;
-            }
 
-            case 'o': {
+            case 'o':
+                if(in_library) {
+                    config.diag() << "Error: -o can't be used here; the output is returned\n";
+                    return false;
+                }
+
                 if(output_specified) {
-                    std::cerr << "Error: You may only specify one output file"
-                              << std::endl;
-                    exit(1);
+                    config.diag() << "Error: You may only specify one output file\n";
+                    return false;
                 }
 
-                std::ofstream *of = new std::ofstream;
-                of->open(optarg);
-                os = of;
                 output_specified = true;
+                config.output_file = optarg;
                 break;
-            }
 
             case 'I':
                 config.includes.push_back(optarg);
@@ -123,12 +198,22 @@ void c2ffi::process_args(config &config, int argc, char *argv[]) {
                 break;
 
             case 'D':
-                if(config.od) {
-                    std::cerr << "Error: you may only specify one output driver"
-                              << std::endl;
-                    exit(1);
+                if(in_library) {
+                    config.diag() << "Error: -D can't be used here; pass the driver instead\n";
+                    return false;
+                }
+
+                if(config.driver) {
+                    config.diag() << "Error: you may only specify one output driver\n";
+                    return false;
+                }
+                config.driver = select_driver(optarg);
+                if(!config.driver) {
+                    config.diag() << "Error: Invalid output driver: " << optarg << "\n";
+                    if(!config.diagnostics)
+                        usage();
+                    return false;
                 }
-                config.od = select_driver(optarg, os);
                 break;
 
             case 'N':
@@ -144,14 +229,12 @@ void c2ffi::process_args(config &config, int argc, char *argv[]) {
                 break;
 
             case 'T':
-                if(config.template_output) {
-                    std::cerr << "Error: you may only specify one template output file"
-                              << std::endl;
-                    exit(1);
+                if(!config.template_file.empty()) {
+                    config.diag() << "Error: you may only specify one template output file\n";
+                    return false;
                 }
 
-                config.template_output = new std::ofstream;
-                config.template_output->open(optarg);
+                config.template_file = optarg;
                 break;
 
             case 'E':
@@ -161,9 +244,9 @@ void c2ffi::process_args(config &config, int argc, char *argv[]) {
             case 'S':
                 config.std = parseStd(optarg);
                 if(config.std == clang::LangStandard::lang_unspecified) {
-                    std::cerr << "Error: unknown standard specified, --std="
-                              << optarg << std::endl;
-                    exit(1);
+                    config.diag() << "Error: unknown standard specified, --std="
+                                  << optarg << "\n";
+                    return false;
                 }
                 break;
 
@@ -189,68 +272,407 @@ void c2ffi::process_args(config &config, int argc, char *argv[]) {
 
             case WCHAR_SIZE:
                 if(config.wchar_size != 0) {
-                    std::cerr << "Error: duplicate argument, --wchar-size=" << optarg << std::endl;
-                    exit(1);
+                    config.diag() << "Error: duplicate argument, --wchar-size=" << optarg << "\n";
+                    return false;
                 }
                 if(strlen(optarg) == 1 && (optarg[0] == '1' || optarg[0] == '2' || optarg[0] == '4'))
                     config.wchar_size = optarg[0] - '0';
                 else {
-                    std::cerr << "Error: invalid argument, --wchar-size=" << optarg << std::endl;
-                    exit(1);
+                    config.diag() << "Error: invalid argument, --wchar-size=" << optarg << "\n";
+                    return false;
                 }
                 break;
 
             case ERROR_LIMIT:
                 if (config.error_limit >= 0) {
-                    std::cerr << "Error: --error-limit cannot be specified multiple times" << std::endl;
-                    exit(1);
+                    config.diag() << "Error: --error-limit cannot be specified multiple times\n";
+                    return false;
                 }
                 int error_limit;
                 char term;
                 if (sscanf(optarg, "%d%c", &error_limit, &term) != 1 || error_limit < 0) {
-                    std::cerr << "Error: error limit must be a valid non-negative integer, --error-limit="
-                              << optarg << std::endl;
-                    exit(1);
+                    config.diag() << "Error: error limit must be a valid non-negative integer, --error-limit="
+                                  << optarg << "\n";
+                    return false;
                 }
                 config.error_limit = error_limit;
                 break;
 
+            case OUTPUT_DIR:
+                config.output_dir = optarg;
+                break;
+
+            case INPUT_LIST:
+                if(!read_input_list(config, optarg))
+                    return false;
+                break;
+
+            case SERVE:
+                config.serve_path = optarg;
+                break;
+
+            case FORK:
+                config.serve_fork = true;
+                break;
+
+            case PRELUDE:
+                config.prelude = optarg;
+                break;
+
+            case PREFIX_HEADER:
+                config.prefix_header = optarg;
+                break;
+
+            case PCH:
+                config.pch = optarg;
+                break;
+
+            case AUTO_PCH:
+                config.auto_pch = true;
+                break;
+
+            case MODULES:
+                config.modules = true;
+                break;
+
+            case MODULE_CACHE:
+                config.modules = true;
+                config.module_cache = optarg;
+                break;
+
+            case MODULE_MAP:
+                config.modules = true;
+                config.module_maps.push_back(optarg);
+                break;
+
+            case CACHE_DIR:
+                config.cache_dir = optarg;
+                break;
+
+            case DEPFILE:
+                config.depfile = optarg;
+                break;
+
+            case MD:
+                config.md = true;
+                break;
+
+            case WATCH:
+                config.watch = true;
+                break;
+
+            case STAT_CACHE:
+                config.stat_cache = optarg;
+                break;
+
+            case CACHE_PREPROCESSED:
+                config.cache_preprocessed = true;
+                break;
+
+            case FAST_PARSE:
+                config.fast_parse = true;
+                break;
+
+            case SYMBOLS: {
+                std::string list = optarg;
+                for(size_t i = 0, end; i <= list.size(); i = end + 1) {
+                    end = std::min(list.find(',', i), list.size());
+                    if(end > i)
+                        config.symbols.insert(list.substr(i, end - i));
+                }
+                break;
+            }
+
+            case STOP_EARLY:
+                config.stop_early = true;
+                break;
+
+            case SYMBOL_REGEX: {
+                std::string error;
+                if(!llvm::Regex(optarg).isValid(error)) {
+                    config.diag() << "Error: Invalid regex: --symbol-regex " << optarg
+                                  << ": " << error << "\n";
+                    return false;
+                }
+                config.symbol_regex.push_back(optarg);
+                break;
+            }
+
+            case REACHABLE:
+                config.reachable = true;
+                break;
+
+            case EXCLUDE_NAMESPACE: {
+                std::string list = optarg;
+                for(size_t i = 0, end; i <= list.size(); i = end + 1) {
+                    end = std::min(list.find(',', i), list.size());
+                    if(end == i)
+                        continue;
+
+                    std::string pattern = list.substr(i, end - i);
+                    auto glob = llvm::GlobPattern::create(pattern);
+                    if(!glob) {
+                        config.diag() << "Error: Invalid pattern: --exclude-namespace " << pattern
+                                      << ": " << llvm::toString(glob.takeError()) << "\n";
+                        return false;
+                    }
+                    config.exclude_ns.push_back(pattern);
+                }
+                break;
+            }
+
+            case KEEP_USED_RECORDS:
+                config.keep_used_records = true;
+                break;
+
+            case ONLY_FROM:
+                if(strpbrk(optarg, "*?[")) {
+                    auto glob = llvm::GlobPattern::create(optarg);
+                    if(!glob) {
+                        config.diag() << "Error: Invalid pattern: --only-from " << optarg
+                                      << ": " << llvm::toString(glob.takeError()) << "\n";
+                        return false;
+                    }
+                }
+                config.only_from.push_back(optarg);
+                break;
+
+            case 'j': {
+                int jobs;
+                char term;
+                if (sscanf(optarg, "%d%c", &jobs, &term) != 1 || jobs < 0) {
+                    config.diag() << "Error: jobs must be a valid non-negative integer, -j "
+                                  << optarg << "\n";
+                    return false;
+                }
+                config.jobs = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+                break;
+            }
+
             case 'h':
-                usage();
-                exit(0);
+                if(!config.diagnostics)
+                    usage();
+                config.help = true;
+                return true;
+
+            case ':':
+                // Only the last argument can be missing its own
+                config.diag() << "Error: Missing argument to " << argv[optind - 1] << "\n";
+                if(!config.diagnostics)
+                    usage();
+                return false;
 
             case '?':
             default:
-                usage();
-                exit(1);
+                config.diag() << "Error: Invalid option: " << bad_option(argv) << "\n";
+                if(!config.diagnostics)
+                    usage();
+                return false;
+        }
+    }
+
+    if(in_library && argc - optind != 1) {
+        config.diag() << "Error: Input files can't be given as options here\n";
+        return false;
+    }
+
+    while(optind < argc)
+        config.inputs.push_back(argv[optind++]);
+
+    if(!config.prefix_header.empty() && config.pch.empty()) {
+        config.diag() << "Error: --prefix-header needs --pch to say where the PCH goes\n";
+        return false;
+    }
+
+    if(config.serve_path.empty() && (config.serve_fork || !config.prelude.empty())) {
+        config.diag() << "Error: --fork and --prelude can only be used with --serve\n";
+        return false;
+    }
+
+    if(config.stop_early && (config.symbols.empty() || !config.symbol_regex.empty())) {
+        config.diag() << "Error: --stop-early needs --symbols, and can't be used with"
+                         " --symbol-regex\n";
+        return false;
+    }
+
+    if(config.keep_used_records && config.exclude_ns.empty()) {
+        config.diag() << "Error: --keep-used-records needs --exclude-namespace\n";
+        return false;
+    }
+
+    if(config.reachable && config.symbols.empty() && config.symbol_regex.empty()) {
+        config.diag() << "Error: --reachable needs --symbols or --symbol-regex\n";
+        return false;
+    }
+
+    if(config.cache_preprocessed && config.cache_dir.empty()) {
+        config.diag() << "Error: --cache-preprocessed needs --cache-dir\n";
+        return false;
+    }
+
+    if(!config.depfile.empty() && config.md) {
+        config.diag() << "Error: --depfile and --MD can't be used together\n";
+        return false;
+    }
+
+    if(config.watch && (!config.serve_path.empty() || !config.output_dir.empty() ||
+                        config.inputs.size() > 1)) {
+        config.diag() << "Error: --watch takes one input, and can't be used with --serve"
+                         " or --output-dir\n";
+        return false;
+    }
+
+    if(config.watch && (config.preprocess_only || !config.cache_dir.empty() ||
+                        !config.stat_cache.empty() || !config.depfile.empty() || config.md)) {
+        config.diag() << "Error: -E, --cache-dir, --stat-cache, --depfile and --MD can't be"
+                         " used with --watch\n";
+        return false;
+    }
+
+    if(!config.serve_path.empty()) {
+        // Each request brings its own options and input file
+        if(!config.inputs.empty()) {
+            config.diag() << "Error: --serve doesn't take input files\n";
+            return false;
+        }
+
+        struct stat buf;
+        if(!config.prelude.empty() && stat(config.prelude.c_str(), &buf) < 0) {
+            config.diag() << "Error: No such file: " << config.prelude << "\n";
+            return false;
+        }
+
+        if(!config.prelude.empty() && !config.prefix_header.empty()) {
+            config.diag() << "Error: --prelude and --prefix-header can't be used together\n";
+            return false;
         }
+
+        return true;
     }
 
-    if(optind >= argc) {
-        std::cerr << "Error: No file specified." << std::endl;
-        usage();
-        exit(1);
-    } else {
-        config.filename = std::string(argv[optind++]);
+    if(config.inputs.empty()) {
+        config.diag() << "Error: No file specified.\n";
+        if(!config.diagnostics)
+            usage();
+        return false;
     }
 
-    struct stat buf;
-    if(stat(config.filename.c_str(), &buf) < 0) {
-        std::cerr << "Error: No such file: " << config.filename
-                  << std::endl;
-        exit(1);
-    } else if(!S_ISREG(buf.st_mode)) {
-        std::cerr << "Error: Not a regular file: " << config.filename
-                  << std::endl;
-        exit(1);
+    // "-" is standard input, which has no extension to tell the language
+    if(std::find(config.inputs.begin(), config.inputs.end(), "-") != config.inputs.end()) {
+        if(config.inputs.size() > 1 || !config.output_dir.empty() || config.watch) {
+            config.diag() << "Error: Standard input must be the only input\n";
+            return false;
+        }
+
+        if(config.lang.empty())
+            config.lang = "c-header";
+    }
+
+    for(auto &&input : config.inputs) {
+        struct stat buf;
+        if(input == "-" || (config.overlay && config.overlay->count(input)))
+            continue;
+
+        if(stat(input.c_str(), &buf) < 0) {
+            config.diag() << "Error: No such file: " << input << "\n";
+            return false;
+        } else if(!S_ISREG(buf.st_mode)) {
+            config.diag() << "Error: Not a regular file: " << input << "\n";
+            return false;
+        }
     }
 
+    if(!config.driver)
+        config.driver = &OutputDrivers[0];
+
+    config.filename = config.inputs[0];
+
+    if(config.inputs.size() > 1 || !config.output_dir.empty()) {
+        // Batch mode: each input gets its own output in --output-dir,
+        // which is opened when the input is processed.
+        if(config.output_dir.empty()) {
+            config.diag() << "Error: --output-dir is required with multiple input files\n";
+            return false;
+        }
+
+        if(output_specified || !config.macro_file.empty() || !config.template_file.empty()) {
+            config.diag() << "Error: -o, -M and -T may not be used with --output-dir\n";
+            return false;
+        }
+
+        if(!config.depfile.empty()) {
+            config.diag() << "Error: --depfile can't be used with --output-dir; use --MD\n";
+            return false;
+        }
+
+        std::set<std::string> outputs;
+        for(auto &&input : config.inputs) {
+            if(!outputs.insert(batch_output_path(config, input)).second) {
+                config.diag() << "Error: Duplicate output file for input: " << input << "\n";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    if(config.auto_pch) {
+        config.diag() << "Error: --auto-pch can only be used with --output-dir\n";
+        return false;
+    }
+
+    // The depfile needs something for the dependencies to be of
+    if(config.md) {
+        if(!output_specified) {
+            config.diag() << "Error: --MD needs -o or --output-dir\n";
+            return false;
+        }
+        config.depfile = config.output_file + ".d";
+    } else if(!config.depfile.empty() && !output_specified &&
+              config.macro_file.empty() && config.template_file.empty()) {
+        config.diag() << "Error: --depfile needs -o, -M or -T\n";
+        return false;
+    }
+
+    // Only opened now, so a bad option doesn't leave them truncated (or
+    // leak the streams)
+    if(output_specified)
+        os = new std::ofstream(config.output_file);
+    if(!config.macro_file.empty())
+        config.macro_output = new std::ofstream(config.macro_file);
+    if(!config.template_file.empty())
+        config.template_output = new std::ofstream(config.template_file);
+
     config.output = os;
+    config.od = config.driver->fn(os);
+    return true;
+}
+
+std::string c2ffi::batch_output_path(const config &config, const std::string &input) {
+    std::string::size_type slash = input.rfind('/');
+    std::string base = (slash == std::string::npos) ? input : input.substr(slash + 1);
 
-    if(!config.od)
-        config.od = OutputDrivers[0].fn(os);
-    else
-        config.od->set_os(os);
+    return config.output_dir + "/" + base + "." + config.driver->name;
+}
+
+bool read_input_list(c2ffi::config &config, const char *path) {
+    std::ifstream in(path);
+    std::string line;
+
+    if(!in) {
+        config.diag() << "Error: Could not read input list: " << path << "\n";
+        return false;
+    }
+
+    while(std::getline(in, line)) {
+        std::string::size_type end = line.find_last_not_of(" \t\r");
+        if(end == std::string::npos || line[0] == '#')
+            continue;
+
+        config.inputs.push_back(line.substr(0, end + 1));
+    }
+
+    return true;
 }
 
 void usage(void) {
@@ -258,7 +680,11 @@ void usage(void) {
     using namespace std;
 
     cout <<
-        "Usage: c2ffi [options ...] FILE\n"
+        "Usage: c2ffi [options ...] FILE ...\n"
+        "\n"
+        "FILE may also be a clang AST (.ast or .pch), which is read instead of\n"
+        "parsing it; the parsing options don't apply then.  A single FILE of -\n"
+        "reads standard input, as a C header unless -x says otherwise.\n"
         "\n"
         "Options:\n"
         "      -I, --include        Add a \"LOCAL\" include path\n"
@@ -271,6 +697,43 @@ void usage(void) {
         "      -M, --macro-file     Specify a file for macro definition output\n"
         "      --with-macro-defs    Also include #defines for macro definitions\n"
         "\n"
+        "      --output-dir         Directory for per-file output when given several\n"
+        "                           input files (FILE.DRIVER, e.g. foo.h.json)\n"
+        "      --input-list         Read additional input files from a file, one per line\n"
+        "      -j, --jobs=N         Process up to N input files in parallel (0: one\n"
+        "                           per CPU); output is the same as with -j 1\n"
+        "\n"
+        "      --serve=SOCKET       Listen on a unix socket and answer parse requests\n"
+        "                           (see README.md for the protocol)\n"
+        "      --fork               With --serve, handle each connection in a forked\n"
+        "                           process, so a crash only loses that connection\n"
+        "      --prelude=FILE       With --serve, precompile FILE at startup, and parse\n"
+        "                           requests as if they included it first\n"
+        "\n"
+        "      --prefix-header=H    Precompile H, and parse every input as if it\n"
+        "                           included H first; needs --pch\n"
+        "      --pch=FILE           Load this PCH before each input; with\n"
+        "                           --prefix-header, it is rebuilt when out of date\n"
+        "      --auto-pch           With --output-dir, precompile the #include <...>\n"
+        "                           lines all inputs start with\n"
+        "      --modules            Use clang modules for headers with a module map\n"
+        "      --module-cache=DIR   Keep built modules in DIR (implies --modules)\n"
+        "      --module-map=FILE    Load a module map (implies --modules)\n"
+        "\n"
+        "      --cache-dir=DIR      Reuse earlier output for an input when neither the\n"
+        "                           options nor any file it includes have changed\n"
+        "      --cache-preprocessed With --cache-dir, also keep the preprocessed\n"
+        "                           input, and parse that while its headers are\n"
+        "                           unchanged\n"
+        "      --depfile=FILE       Write a make/ninja depfile listing every file read,\n"
+        "                           with the -o, -M and -T files as targets\n"
+        "      --MD                 Write the depfile to each output file plus .d\n"
+        "      --stat-cache=FILE    Remember in FILE which headers header search\n"
+        "                           didn't find, until their directory changes\n"
+        "      --watch              Process the input again whenever it or a file it\n"
+        "                           includes changes; the headers it starts with are\n"
+        "                           kept precompiled in memory\n"
+        "\n"
         "      -N, --namespace      Specify target namespace/package/etc\n"
         "\n"
         "      -A, --arch           Specify the target triple for LLVM\n"
@@ -286,6 +749,23 @@ void usage(void) {
         "      --fail-on-error      Fail command if any compilation error occurs\n"
         "      --warn-as-error      Treat warnings as errors\n"
         "      --error-limit=N      Display a maximum of N errors (N must be an integer >= 0)\n"
+        "      --fast-parse         Don't parse function bodies, which c2ffi doesn't\n"
+        "                           use, and ignore warnings\n"
+        "\n"
+        "      --symbols=A,B,...    Only write the declarations with these names\n"
+        "                           (functions, variables, typedefs, tags)\n"
+        "      --symbol-regex=RE    Also write declarations whose whole name matches RE\n"
+        "      --reachable          Also write what those declarations use, and\n"
+        "                           what that uses, and so on\n"
+        "      --stop-early         Stop parsing once all of --symbols, and with\n"
+        "                           --reachable what they use, have been seen\n"
+        "      --only-from=PATH     Only write declarations from PATH, a file or\n"
+        "                           directory, or a glob (may be repeated)\n"
+        "      --exclude-namespace=A,B,...\n"
+        "                           Don't write these namespaces or anything in them;\n"
+        "                           globs match the qualified name (e.g. std::__*)\n"
+        "      --keep-used-records  Do write the records in excluded namespaces that\n"
+        "                           other declarations use\n"
         "\n"
         "Drivers: ";
 
@@ -299,7 +779,7 @@ void usage(void) {
     cout << endl;
 }
 
-c2ffi::OutputDriver* select_driver(std::string name, std::ostream *os) {
+const c2ffi::OutputDriverField* select_driver(std::string name) {
     using namespace c2ffi;
     using namespace std;
 
@@ -307,10 +787,8 @@ c2ffi::OutputDriver* select_driver(std::string name, std::ostream *os) {
         if(!OutputDrivers[i].name) break;
 
         if(name == OutputDrivers[i].name)
-            return OutputDrivers[i].fn(os);
+            return &OutputDrivers[i];
     }
 
-    cerr << "Error: Invalid output driver: " << name << endl;
-    usage();
-    exit(1);
+    return NULL;
 }
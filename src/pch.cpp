@@ -0,0 +1,367 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/xxhash.h>
+
+#include <clang/AST/ASTContext.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Parse/ParseAST.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Serialization/ASTWriter.h>
+
+#include "c2ffi.h"
+#include "c2ffi/cache.h"
+#include "c2ffi/init.h"
+#include "c2ffi/opt.h"
+#include "c2ffi/pch.h"
+#include "c2ffi/resources.h"
+
+using namespace c2ffi;
+
+// Everything that changes what the PCH would contain, or that clang
+// checks when loading it
+static std::string pch_key(const config &c, const std::string &header) {
+    std::string key = c.c2ffi_binpath + ' ' + header + " -A " + c.arch +
+        " -x " + c.lang + " --std " + std::to_string((int)c.std) +
+        " --wchar-size " + std::to_string(c.wchar_size) + " --pch " + c.pch;
+
+    if(c.nostdinc)
+        key += " --nostdinc";
+    if(c.declspec)
+        key += " --declspec";
+    if(c.fast_parse)
+        key += c.template_output ? " --fast-parse -T" : " --fast-parse";
+    for(auto &&inc : c.includes)
+        key += " -I " + inc;
+    for(auto &&inc : c.sys_includes)
+        key += " -i " + inc;
+    if(c.modules)
+        key += " --modules --module-cache " + c.module_cache;
+    for(auto &&map : c.module_maps)
+        key += " --module-map " + map;
+
+    return key;
+}
+
+static bool pch_is_current(const config &c, const std::string &header,
+                           const std::string &path) {
+    struct stat pch, dep;
+    std::ifstream deps(path + ".deps");
+    std::string line;
+
+    if(stat(path.c_str(), &pch) < 0 || !std::getline(deps, line) ||
+       line != pch_key(c, header))
+        return false;
+
+    while(std::getline(deps, line)) {
+        if(stat(line.c_str(), &dep) < 0 || dep.st_mtime >= pch.st_mtime)
+            return false;
+    }
+
+    return true;
+}
+
+static bool write_file(const config &c, const std::string &path,
+                       const char *data, size_t size) {
+    if(!replace_file(path, data, size)) {
+        c.diag() << "Error: Could not write " << path << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+// The line of the first #include in the main file whose header isn't
+// include-guarded, or 0
+static unsigned first_unguarded(clang::CompilerInstance &ci) {
+    clang::SourceManager &sm = ci.getSourceManager();
+    clang::HeaderSearch &hs = ci.getPreprocessor().getHeaderSearchInfo();
+    unsigned first = 0;
+
+    for(auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it) {
+        clang::FileID fid = sm.translateFile(it->first);
+        clang::SourceLocation loc = fid.isValid() ? sm.getIncludeLoc(fid)
+                                                  : clang::SourceLocation();
+
+        if(loc.isValid() && sm.getFileID(loc) == sm.getMainFileID() &&
+           !hs.isFileMultipleIncludeGuarded(it->first)) {
+            unsigned line = sm.getSpellingLineNumber(loc);
+            if(!first || line < first)
+                first = line;
+        }
+    }
+
+    return first;
+}
+
+bool c2ffi::build_pch(const config &sys, const std::string &header,
+                      const std::string &pch, unsigned *unguarded) {
+    clang::CompilerInstance ci;
+    config c = sys;
+
+    c.filename = header;
+    c.preprocess_only = false;
+
+    if(!init_ci(c, ci, NULL, clang::TU_Prefix))
+        return false;
+
+    if(!add_includes(ci, c.includes, false, true) ||
+       !add_includes(ci, c.sys_includes, true, true))
+        return false;
+
+    auto file = ci.getFileManager().getFile(c.filename);
+    if(!file) {
+        c.diag() << "Error: No such file: " << c.filename << "\n";
+        return false;
+    }
+
+    clang::SourceManager &sm = ci.getSourceManager();
+    sm.setMainFileID(sm.createFileID(*file, clang::SourceLocation(),
+                                     clang::SrcMgr::C_User));
+    ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(),
+                                             &ci.getPreprocessor());
+
+    auto buffer = std::make_shared<clang::PCHBuffer>();
+    auto *gen = new clang::PCHGenerator(ci.getPreprocessor(), ci.getModuleCache(),
+                                        pch, "", buffer, {});
+    ci.setASTConsumer(std::unique_ptr<clang::ASTConsumer>(gen));
+
+    ci.createASTContext();
+
+    // The generator hears about the PCH being loaded, and writes only
+    // what's new on top of it
+    if(!c.pch.empty()) {
+        ci.createPCHExternalASTSource(c.pch, false, false,
+                                      gen->GetASTDeserializationListener(), false);
+        if(!ci.getASTContext().getExternalSource()) {
+            c.diag() << "Error: Could not load PCH: " << c.pch << "\n";
+            return false;
+        }
+    }
+
+    ci.createSema(clang::TU_Prefix, nullptr);
+    clang::ParseAST(ci.getSema(), false, ci.getFrontendOpts().SkipFunctionBodies);
+    ci.getDiagnosticClient().EndSourceFile();
+
+    if(ci.getDiagnostics().hasErrorOccurred() || !buffer->IsComplete) {
+        c.diag() << "Error: Could not build PCH from " << header << "\n";
+        return false;
+    }
+
+    if(unguarded)
+        *unguarded = first_unguarded(ci);
+
+    std::string deps = pch_key(c, header) + "\n";
+    if(!c.pch.empty())
+        deps += c.pch + "\n";
+    for(auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it) {
+        std::string dep = it->first->getName().str();
+        if(!is_embedded(dep))
+            deps += dep + "\n";
+    }
+
+    // The PCH first: a new .deps next to the old PCH would pass it as current
+    return write_file(c, pch, buffer->Data.data(), buffer->Data.size()) &&
+        write_file(c, pch + ".deps", deps.data(), deps.size());
+}
+
+std::string c2ffi::keyed_pch(const config &c, const std::string &header,
+                            const std::string &pch) {
+    return pch + "." + llvm::utohexstr(llvm::xxHash64(pch_key(c, header)), true);
+}
+
+bool c2ffi::update_pch(const config &c, const std::string &header,
+                       const std::string &pch, unsigned *unguarded) {
+    // Threads that find it out of date at the same time build it once
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+
+    if(unguarded)
+        *unguarded = 0;
+    return pch_is_current(c, header, pch) || build_pch(c, header, pch, unguarded);
+}
+
+// Strip comments from LINE, which may start inside a block comment
+static std::string strip_comments(const std::string &line, bool &in_comment) {
+    std::string result;
+
+    for(size_t i = 0; i < line.size(); i++) {
+        if(in_comment) {
+            if(line.compare(i, 2, "*/") == 0) {
+                in_comment = false;
+                i++;
+            }
+        } else if(line.compare(i, 2, "/*") == 0) {
+            in_comment = true;
+            i++;
+        } else if(line.compare(i, 2, "//") == 0) {
+            break;
+        } else {
+            result += line[i];
+        }
+    }
+
+    return result;
+}
+
+// The #include <...> lines at the top of PATH.  This stops at the first
+// line that isn't one of those, a comment, #pragma once or an include
+// guard, since anything else could change what the includes mean.
+static IncludeVector leading_includes(const std::string &path) {
+    std::ifstream in(path);
+    IncludeVector result;
+    std::string line, guard;
+    bool in_comment = false;
+
+    while(std::getline(in, line)) {
+        std::string text = strip_comments(line, in_comment);
+        size_t start = text.find_first_not_of(" \t\r");
+
+        if(start == std::string::npos)
+            continue;
+        if(text[start] != '#')
+            break;
+
+        // "#  include<foo.h>" is fine too
+        size_t name = std::min(text.find_first_not_of(" \t", start + 1), text.size());
+        size_t end = std::min(text.find_first_not_of("abcdefghijklmnopqrstuvwxyz", name),
+                              text.size());
+        std::string directive = text.substr(name, end - name), arg;
+        std::istringstream(text.substr(end)) >> arg;
+
+        if(directive == "include" && arg.size() > 2 && arg.front() == '<' &&
+           arg.back() == '>') {
+            result.push_back(arg);
+        } else if(directive == "pragma" && arg == "once") {
+            continue;
+        } else if(directive == "ifndef" && guard.empty() && result.empty()) {
+            guard = arg;
+        } else if(directive == "define" && !guard.empty() && arg == guard) {
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    return result;
+}
+
+IncludeVector c2ffi::common_includes(const IncludeVector &inputs) {
+    IncludeVector common;
+
+    for(size_t i = 0; i < inputs.size(); i++) {
+        IncludeVector includes = leading_includes(inputs[i]);
+
+        if(i == 0) {
+            common = includes;
+        } else {
+            auto end = std::mismatch(common.begin(), common.end(),
+                                     includes.begin(), includes.end());
+            common.erase(end.first, common.end());
+        }
+
+        if(common.empty())
+            break;
+    }
+
+    return common;
+}
+
+static bool write_prefix(const config &c, const std::string &path,
+                         const std::string &list, const IncludeVector &includes) {
+    std::string text = "//" + list + "\n";
+    for(auto &&inc : includes)
+        text += "#include " + inc + "\n";
+
+    return write_file(c, path, text.data(), text.size());
+}
+
+bool c2ffi::use_auto_pch(config &c) {
+    IncludeVector common = common_includes(c.inputs);
+    if(c.inputs.size() < 2 || common.empty())
+        return true;
+
+    if(!c.prefix_header.empty()) {
+        config base = c;
+        base.pch.clear();
+        if(!update_pch(base, c.prefix_header, c.pch))
+            return false;
+    }
+
+    std::string header = c.output_dir + "/.c2ffi-prefix.h";
+    std::string pch = c.output_dir + "/.c2ffi-prefix.pch";
+    std::string list, line;
+    for(auto &&inc : common)
+        list += " " + inc;
+
+    // The first line lists every common include, so a header cut short
+    // below is kept while they stay the same.  Rewriting it would make
+    // the PCH look out of date.
+    std::ifstream in(header);
+    IncludeVector includes;
+
+    if(std::getline(in, line) && line == "//" + list) {
+        while(in >> line >> line)
+            includes.push_back(line);
+    } else {
+        includes = common;
+        if(!write_prefix(c, header, list, includes))
+            return false;
+    }
+
+    // The inputs include these again themselves.  That's only a no-op,
+    // as the output needs it to be, for include-guarded headers, so the
+    // prefix stops before the first that isn't.
+    for(;;) {
+        unsigned unguarded;
+
+        if(includes.empty())
+            return true;
+        if(!update_pch(c, header, pch, &unguarded))
+            return false;
+        if(!unguarded)
+            break;
+
+        includes.resize(std::min<size_t>(unguarded - 2, includes.size() - 1));
+        if(!write_prefix(c, header, list, includes))
+            return false;
+    }
+
+    // The new PCH already includes the old one
+    c.prefix_header.clear();
+    c.pch = pch;
+    return true;
+}
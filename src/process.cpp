@@ -0,0 +1,590 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <iterator>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/DeclBase.h>
+#include <clang/AST/DeclGroup.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Parse/ParseAST.h>
+#include <clang/Sema/Sema.h>
+
+#include "c2ffi.h"
+#include "c2ffi/cache.h"
+#include "c2ffi/init.h"
+#include "c2ffi/opt.h"
+#include "c2ffi/ast.h"
+#include "c2ffi/macros.h"
+#include "c2ffi/pch.h"
+#include "c2ffi/process.h"
+#include "c2ffi/resources.h"
+#include "c2ffi/statcache.h"
+
+using namespace c2ffi;
+
+static void begin_output(config &sys) {
+    // With only a DeclVisitor there is no driver to write to
+    if(sys.od) {
+        sys.od->write_header();
+
+        if(sys.to_namespace != "")
+            sys.od->write_namespace(sys.to_namespace);
+    }
+}
+
+static void end_output(config &sys, clang::CompilerInstance &ci,
+                       C2FFIASTConsumer *astc) {
+    astc->PostProcess();
+
+    if(sys.od)
+        sys.od->write_footer();
+
+    if(sys.macro_output) {
+        process_macros(ci, *sys.macro_output, sys);
+        sys.macro_output->close();
+    }
+
+    if(sys.template_output)
+        sys.template_output->close();
+}
+
+// A PCH stands in for including its header first, but the parse never
+// hands its decls to the consumer.  Hand them on here, in the header's
+// order, leaving out those in SKIP and those from modules (their imports
+// bring them in).  False if the consumer wants no more.
+static bool handle_pch_decls(clang::ASTContext &ctx, C2FFIASTConsumer *astc,
+                             const std::set<clang::Decl*> &skip = {}) {
+    std::vector<clang::Decl*> decls;
+
+    for(clang::Decl *d : ctx.getTranslationUnitDecl()->decls()) {
+        if(d->isFromASTFile() && !d->isImplicit() && !d->getOwningModule() &&
+           !skip.count(d))
+            decls.push_back(d);
+    }
+
+    for(clang::Decl *d : decls) {
+        if(!astc->HandleTopLevelDecl(clang::DeclGroupRef(d)))
+            return false;
+    }
+    return true;
+}
+
+int c2ffi::process_unit(config &sys, clang::ASTUnit &unit) {
+    clang::CompilerInstance ci;
+    init_ci_from(sys, ci, unit);
+
+    C2FFIASTConsumer *astc = new C2FFIASTConsumer(ci, sys);
+    ci.setASTConsumer(std::unique_ptr<clang::ASTConsumer>(astc));
+
+    begin_output(sys);
+
+    if(unit.isMainFileAST()) {
+        // A serialized AST has been through Sema already.  Sema's own
+        // implicit decls never reach a consumer in a normal parse, and
+        // those from modules come in with their imports.
+        std::vector<clang::Decl*> decls;
+        for(clang::Decl *d : unit.getASTContext().getTranslationUnitDecl()->decls()) {
+            if(!d->isImplicit() && !d->getOwningModule())
+                decls.push_back(d);
+        }
+
+        for(clang::Decl *d : decls) {
+            if(!astc->HandleTopLevelDecl(clang::DeclGroupRef(d)))
+                break;
+        }
+    } else {
+        // Parsed from source: these are the decls a parse would have
+        // handed to the consumer, in the same order
+        std::vector<clang::Decl*> decls(unit.top_level_begin(), unit.top_level_end());
+        bool more = sys.pch.empty() ||
+            handle_pch_decls(unit.getASTContext(), astc,
+                             std::set<clang::Decl*>(decls.begin(), decls.end()));
+
+        for(auto it = decls.begin(); more && it != decls.end(); ++it)
+            more = astc->HandleTopLevelDecl(clang::DeclGroupRef(*it));
+    }
+
+    end_output(sys, ci, astc);
+
+    if(sys.output)
+        sys.output->flush();
+
+    if(sys.fail_on_error && unit.getDiagnostics().hasErrorOccurred())
+        return 1;
+    return 0;
+}
+
+static int process_ast(config &sys, IncludeVector *deps) {
+    if(sys.preprocess_only) {
+        sys.diag() << "Error: -E can't be used with an AST file\n";
+        return 1;
+    }
+
+    std::unique_ptr<clang::ASTUnit> unit = load_ast(sys);
+    if(!unit)
+        return 1;
+
+    int r = process_unit(sys, *unit);
+    unit->getDiagnostics().getClient()->EndSourceFile();
+
+    if(deps)
+        deps->push_back(sys.filename);
+    return r;
+}
+
+static int parse_file(config &sys, session *s, IncludeVector *deps = NULL,
+                      bool *errors = NULL);
+
+// --cache-preprocessed applies where the -E output parses to the same
+// thing: -M needs the #defines, and a PCH or modules aren't in the output
+static bool use_preprocessed(const config &sys) {
+    return sys.cache_preprocessed && !sys.cache_dir.empty() && !sys.preprocess_only &&
+        !sys.macro_output && sys.pch.empty() && !sys.modules && !sys.overlay &&
+        sys.filename != "-";
+}
+
+// The input as -E writes it, line markers and all, which is kept in
+// --cache-dir until one of the files it came from changes.  DEPS gets
+// those files.  Null if preprocessing gave errors; the input is then
+// parsed the usual way, which reports them.
+static std::unique_ptr<llvm::MemoryBuffer> preprocessed_input(config &sys, session *s,
+                                                              IncludeVector &deps) {
+    session local;
+    OutputCache cache(sys, s ? *s : local, true);
+    cached_result r;
+
+    if(!cache.lookup(r, &deps)) {
+        config c = sys;
+        std::ostringstream out;
+        llvm::raw_string_ostream diag(r.diagnostics);
+        time_t start = time(NULL);
+
+        c.preprocess_only = true;
+        c.fail_on_error = true;
+        c.output = &out;
+        c.diagnostics = &diag;
+
+        r.status = parse_file(c, s ? s : &local, &deps);
+        diag.flush();
+        if(r.status != 0) {
+            deps.clear();
+            return nullptr;
+        }
+
+        r.output = out.str();
+        cache.store(r, deps, start);
+    }
+
+    sys.diag() << r.diagnostics;
+    return llvm::MemoryBuffer::getMemBufferCopy(r.output, sys.filename);
+}
+
+// DEPS, if given, gets every file the parse read, and ERRORS whether
+// there were errors even if they didn't fail the run
+static int parse_file(config &sys, session *s, IncludeVector *deps, bool *errors) {
+    IncludeVector pp_deps;
+    std::unique_ptr<llvm::MemoryBuffer> pp;
+
+    if(use_preprocessed(sys))
+        pp = preprocessed_input(sys, s, pp_deps);
+
+    clang::CompilerInstance ci;
+
+    // this finishes parsing the arguments using clang
+    if(!init_ci(sys, ci, s))
+        return 1;
+
+    if(!add_includes(ci, sys.includes, false, true) ||
+       !add_includes(ci, sys.sys_includes, true, true))
+        return 1;
+
+    C2FFIASTConsumer *astc = NULL;
+    clang::FileID fid;
+
+    if(sys.filename == "-") {
+        auto buf = llvm::MemoryBuffer::getSTDIN();
+        if(!buf) {
+            sys.diag() << "Error: Could not read standard input\n";
+            return 1;
+        }
+
+        fid = ci.getSourceManager().createFileID(std::move(*buf), clang::SrcMgr::C_User);
+    } else if(pp) {
+        // The line markers give everything in it its original location
+        fid = ci.getSourceManager().createFileID(std::move(pp), clang::SrcMgr::C_User);
+    } else {
+        auto file = ci.getFileManager().getFile(sys.filename);
+        if(!file) {
+            sys.diag() << "Error: No such file: " << sys.filename << "\n";
+            return 1;
+        }
+
+        fid = ci.getSourceManager().createFileID(*file, clang::SourceLocation(),
+                                                 clang::SrcMgr::C_User);
+    }
+
+    ci.getSourceManager().setMainFileID(fid);
+    ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(),
+                                             &ci.getPreprocessor());
+
+    if(sys.preprocess_only) {
+        llvm::raw_ostream *os = new llvm::raw_os_ostream(*sys.output);
+        clang::DoPrintPreprocessedInput(ci.getPreprocessor(), os,
+                                        ci.getPreprocessorOutputOpts());
+        delete os;
+    } else {
+        astc = new C2FFIASTConsumer(ci, sys);
+        ci.setASTConsumer(std::unique_ptr<clang::ASTConsumer>(astc));
+        ci.createASTContext();
+
+        const std::string &pch = ci.getPreprocessorOpts().ImplicitPCHInclude;
+        if(!pch.empty()) {
+            ci.createPCHExternalASTSource(pch, false, false, nullptr, false);
+            if(!ci.getASTContext().getExternalSource()) {
+                sys.diag() << "Error: Could not load PCH: " << pch << "\n";
+                return 1;
+            }
+        }
+
+        begin_output(sys);
+
+        // Modules are loaded through ci, which needs to know the Sema
+        ci.createSema(clang::TU_Complete, nullptr);
+        if(pch.empty() || handle_pch_decls(ci.getASTContext(), astc))
+            clang::ParseAST(ci.getSema(), false, ci.getFrontendOpts().SkipFunctionBodies);
+        end_output(sys, ci, astc);
+    }
+
+    ci.getDiagnosticClient().EndSourceFile();
+    if(sys.output)
+        sys.output->flush();
+
+    if(deps) {
+        clang::SourceManager &sm = ci.getSourceManager();
+        for(auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it)
+            deps->push_back(it->first->getName().str());
+        deps->insert(deps->end(), pp_deps.begin(), pp_deps.end());
+
+        // A PCH c2ffi built says what went into it
+        if(!sys.pch.empty()) {
+            std::ifstream in(sys.pch + ".deps");
+            std::string line;
+
+            deps->push_back(sys.pch);
+            if(std::getline(in, line)) {
+                while(std::getline(in, line))
+                    deps->push_back(line);
+            }
+        }
+
+        std::sort(deps->begin(), deps->end());
+        deps->erase(std::unique(deps->begin(), deps->end()), deps->end());
+        deps->erase(std::remove_if(deps->begin(), deps->end(), is_embedded), deps->end());
+    }
+
+    if(errors)
+        *errors = ci.getDiagnostics().hasErrorOccurred();
+
+    if(sys.fail_on_error && ci.getDiagnostics().hasErrorOccurred())
+        return 1;
+    return 0;
+}
+
+namespace {
+    // Passes diagnostics on, keeping a copy
+    class TeeStream : public llvm::raw_ostream {
+        llvm::raw_ostream &_os;
+        std::string &_copy;
+
+        void write_impl(const char *ptr, size_t size) override {
+            _os.write(ptr, size);
+            _copy.append(ptr, size);
+        }
+
+        uint64_t current_pos() const override { return _copy.size(); }
+
+    public:
+        TeeStream(llvm::raw_ostream &os, std::string &copy)
+            : _os(os), _copy(copy) {
+            SetUnbuffered();
+        }
+    };
+}
+
+static std::string read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+}
+
+// With --cache-dir, an input whose options and dependencies are the same
+// as on an earlier run gets that run's results without being parsed.
+static int process_cached(config &sys, session *s, IncludeVector *out_deps) {
+    session local;
+    OutputCache cache(sys, s ? *s : local);
+    cached_result r;
+
+    if(cache.lookup(r, out_deps)) {
+        sys.diag() << r.diagnostics;
+        *sys.output << r.output;
+        sys.output->flush();
+
+        if(sys.macro_output) {
+            *sys.macro_output << r.macros;
+            sys.macro_output->close();
+        }
+
+        if(sys.template_output) {
+            *sys.template_output << r.templates;
+            sys.template_output->close();
+        }
+
+        return r.status;
+    }
+
+    // Capture what the run writes, and pass it on
+    std::ostream *output = sys.output;
+    std::ostringstream buf;
+    TeeStream diag(sys.diag(), r.diagnostics);
+    config c = sys;
+    IncludeVector deps;
+    bool errors = true;
+    time_t start = time(NULL);
+
+    c.output = &buf;
+    c.diagnostics = &diag;
+    c.od->set_os(&buf);
+
+    r.status = parse_file(c, s ? s : &local, &deps, &errors);
+
+    sys.od->set_os(output);
+    r.output = buf.str();
+    *output << r.output;
+    output->flush();
+
+    if(sys.macro_output)
+        r.macros = read_file(sys.macro_file);
+    if(sys.template_output)
+        r.templates = read_file(sys.template_file);
+
+    // Errors may come from something the key doesn't cover, such as a
+    // missing header that appears later
+    if(!errors)
+        cache.store(r, deps, start);
+
+    if(out_deps)
+        *out_deps = deps;
+    return r.status;
+}
+
+static std::string depfile_escape(const std::string &path) {
+    std::string s;
+
+    for(char c : path) {
+        if(c == ' ' || c == '#')
+            s += '\\';
+        else if(c == '$')
+            s += '$';
+        s += c;
+    }
+
+    return s;
+}
+
+// In the form make and ninja read: the files written, then what they
+// were made from
+static bool write_depfile(const config &sys, const IncludeVector &deps) {
+    std::ofstream out(sys.depfile);
+    const char *sep = "";
+
+    for(auto *target : { &sys.output_file, &sys.macro_file, &sys.template_file }) {
+        if(!target->empty()) {
+            out << sep << depfile_escape(*target);
+            sep = " ";
+        }
+    }
+
+    out << ":";
+    for(auto &&dep : deps)
+        out << " \\\n  " << depfile_escape(dep);
+    out << "\n";
+
+    out.close();
+    if(!out) {
+        sys.diag() << "Error: Could not write depfile: " << sys.depfile << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+static int run_file(config &sys, session *s, IncludeVector *deps) {
+    if(is_ast_file(sys))
+        return process_ast(sys, deps);
+
+    if(!sys.prefix_header.empty() && !sys.preprocess_only) {
+        config base = sys;
+        base.pch.clear();
+        if(!update_pch(base, sys.prefix_header, sys.pch))
+            return 1;
+    }
+
+    // Modules are read without the files in them being opened, so the
+    // cache couldn't tell when they change, and it can only check files
+    // that are on disk
+    if(!sys.cache_dir.empty() && sys.od && sys.output && !sys.visitor &&
+       !sys.preprocess_only && !sys.modules && !sys.overlay && sys.filename != "-")
+        return process_cached(sys, s, deps);
+
+    return parse_file(sys, s, deps);
+}
+
+int c2ffi::process_file(config &sys, session *s) {
+    IncludeVector deps;
+
+    // Directories may have changed since the last input
+    new_stat_cache_run(sys);
+    int r = run_file(sys, s, sys.depfile.empty() ? NULL : &deps);
+
+    // What header search found missing, for the next run to skip
+    save_stat_cache(sys);
+
+    if(!sys.depfile.empty() && !write_depfile(sys, deps))
+        return 1;
+    return r;
+}
+
+static int process_input(c2ffi::config &sys, const std::string &input,
+                         c2ffi::session &s, llvm::raw_ostream *diagnostics) {
+    c2ffi::config c = sys;
+    std::string path = batch_output_path(sys, input);
+    std::ofstream out(path);
+
+    c.diagnostics = diagnostics;
+
+    if(!out) {
+        c.diag() << "Error: Could not open output file: " << path << "\n";
+        return 1;
+    }
+
+    std::unique_ptr<c2ffi::OutputDriver> od(sys.driver->fn(&out));
+    c.filename = input;
+    c.output = &out;
+    c.output_file = path;
+    c.od = od.get();
+
+    if(sys.md)
+        c.depfile = path + ".d";
+
+    return process_file(c, &s);
+}
+
+// Inputs are handed out to the workers one at a time, so a slow header
+// doesn't hold up a whole share of the batch.  Each input still writes its
+// own output file, and diagnostics are buffered and printed in input order,
+// so the result is the same as a serial run.
+static int process_parallel(c2ffi::config &sys) {
+    size_t n = sys.inputs.size();
+    std::vector<std::string> diags(n);
+    std::vector<int> status(n, -1);
+    std::atomic<size_t> next(0);
+    std::mutex lock;
+    std::condition_variable done;
+
+    auto worker = [&]() {
+        // FileManager isn't thread-safe, so every worker has its own session
+        c2ffi::session s;
+
+        for(size_t i; (i = next++) < n;) {
+            std::string buf;
+            llvm::raw_string_ostream diag(buf);
+            int r = process_input(sys, sys.inputs[i], s, &diag);
+            diag.flush();
+
+            std::lock_guard<std::mutex> guard(lock);
+            diags[i] = std::move(buf);
+            status[i] = r;
+            done.notify_one();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(size_t j = 0; j < std::min<size_t>(sys.jobs, n); j++)
+        workers.emplace_back(worker);
+
+    int result = 0;
+    for(size_t i = 0; i < n; i++) {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&] { return status[i] >= 0; });
+
+        sys.diag() << diags[i];
+        sys.diag().flush();
+        if(status[i])
+            result = 1;
+    }
+
+    for(auto &&w : workers)
+        w.join();
+
+    return result;
+}
+
+int c2ffi::process_batch(config &sys) {
+    if(sys.auto_pch && !sys.preprocess_only && !use_auto_pch(sys))
+        return 1;
+
+    if(sys.jobs > 1 && sys.inputs.size() > 1)
+        return process_parallel(sys);
+
+    c2ffi::session s;
+    int result = 0;
+
+    for(auto &&input : sys.inputs) {
+        if(process_input(sys, input, s, sys.diagnostics))
+            result = 1;
+    }
+
+    return result;
+}
@@ -0,0 +1,97 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "c2ffi/resources.h"
+
+using namespace c2ffi;
+
+#ifdef C2FFI_EMBED_RESOURCE_HEADERS
+namespace {
+    struct embedded_file {
+        const char *path;
+        const unsigned char *data;
+        size_t size;
+    };
+
+    // Generated by CMake/embed_headers.cmake: resource_headers[], ending
+    // with a null path
+    #include "resource_headers.inc"
+}
+
+// Nothing is there on disk, so the embedded headers can't be shadowed
+static const char resource_path[] = "/c2ffi-resource";
+#endif
+
+const char *c2ffi::resource_dir() {
+#ifdef C2FFI_EMBED_RESOURCE_HEADERS
+    return resource_path;
+#else
+    return CLANG_RESOURCE_DIRECTORY;
+#endif
+}
+
+bool c2ffi::is_embedded(const std::string &path) {
+#ifdef C2FFI_EMBED_RESOURCE_HEADERS
+    return path.compare(0, sizeof(resource_path) - 1, resource_path) == 0 &&
+        path[sizeof(resource_path) - 1] == '/';
+#else
+    return false;
+#endif
+}
+
+static llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> make_file_system() {
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> real = llvm::vfs::getRealFileSystem();
+
+#ifdef C2FFI_EMBED_RESOURCE_HEADERS
+    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> fs =
+        new llvm::vfs::OverlayFileSystem(real);
+    llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> mem =
+        new llvm::vfs::InMemoryFileSystem;
+
+    if(auto cwd = real->getCurrentWorkingDirectory())
+        mem->setCurrentWorkingDirectory(*cwd);
+
+    // The data is NUL-terminated past its size, so the buffers needn't
+    // be copied
+    std::string include = std::string(resource_path) + "/include/";
+    for(const embedded_file *f = resource_headers; f->path; f++) {
+        llvm::StringRef data((const char*)f->data, f->size);
+        mem->addFile(include + f->path, 0,
+                     llvm::MemoryBuffer::getMemBuffer(data, include + f->path));
+    }
+
+    fs->pushOverlay(mem);
+    return fs;
+#else
+    return real;
+#endif
+}
+
+// Nothing changes it once it's built, and its reference count is atomic,
+// so every thread can share it
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> c2ffi::file_system() {
+    static llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = make_file_system();
+    return fs;
+}
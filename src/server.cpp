@@ -0,0 +1,540 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <clang/Basic/FileManager.h>
+
+#include "c2ffi.h"
+#include "c2ffi/init.h"
+#include "c2ffi/opt.h"
+#include "c2ffi/pch.h"
+#include "c2ffi/process.h"
+#include "c2ffi/server.h"
+#include "c2ffi/statcache.h"
+
+using namespace c2ffi;
+
+namespace {
+    enum FrameType : char {
+        REQUEST     = 'R',
+        OUTPUT      = 'O',
+        DIAGNOSTICS = 'E',
+        STATUS      = 'S'
+    };
+
+    class Connection {
+        int _fd;
+        bool _ok = true;
+
+    public:
+        Connection(int fd) : _fd(fd) { }
+        ~Connection() { close(_fd); }
+
+        // False once the client has gone away; the current request still
+        // runs to completion, but nothing more is sent.
+        bool ok() const { return _ok; }
+
+        bool read_frame(char &type, std::string &payload);
+        void write_frame(char type, const char *data, size_t size);
+    };
+
+    // What the output driver writes is sent on as OUTPUT frames
+    class FrameBuf : public std::streambuf {
+        Connection &_conn;
+        char _buf[16384];
+
+    public:
+        FrameBuf(Connection &conn) : _conn(conn) {
+            setp(_buf, _buf + sizeof(_buf));
+        }
+
+    protected:
+        int overflow(int ch) override {
+            sync();
+            if(ch != traits_type::eof()) {
+                *pptr() = ch;
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+
+        int sync() override {
+            if(pptr() > pbase())
+                _conn.write_frame(OUTPUT, pbase(), pptr() - pbase());
+            setp(_buf, _buf + sizeof(_buf));
+            return 0;
+        }
+    };
+
+    // Diagnostics are flushed after each message, so each becomes a frame
+    class FrameStream : public llvm::raw_ostream {
+        Connection &_conn;
+        uint64_t _pos = 0;
+
+        void write_impl(const char *ptr, size_t size) override {
+            _conn.write_frame(DIAGNOSTICS, ptr, size);
+            _pos += size;
+        }
+
+        uint64_t current_pos() const override { return _pos; }
+
+    public:
+        FrameStream(Connection &conn) : _conn(conn) { }
+        ~FrameStream() { flush(); }
+    };
+
+    // Sessions outlive their requests, so each request starts with the
+    // invocations a previous one left behind.  A session is only used by
+    // one request at a time.
+    class SessionPool {
+        std::mutex _lock;
+        std::vector<std::unique_ptr<session>> _free;
+
+    public:
+        std::unique_ptr<session> get();
+        void put(std::unique_ptr<session> s);
+    };
+}
+
+static bool read_all(int fd, char *buf, size_t size) {
+    while(size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const char *buf, size_t size) {
+    while(size > 0) {
+        ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return false;
+
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool Connection::read_frame(char &type, std::string &payload) {
+    unsigned char header[5];
+
+    if(!_ok || !read_all(_fd, (char*)header, sizeof(header)))
+        return false;
+
+    type = header[0];
+    payload.resize((uint32_t)header[1] << 24 | (uint32_t)header[2] << 16 |
+                   (uint32_t)header[3] << 8 | (uint32_t)header[4]);
+
+    return read_all(_fd, &payload[0], payload.size());
+}
+
+void Connection::write_frame(char type, const char *data, size_t size) {
+    unsigned char header[5] = {
+        (unsigned char)type,
+        (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+        (unsigned char)(size >> 8), (unsigned char)size
+    };
+
+    _ok = _ok && write_all(_fd, (const char*)header, sizeof(header)) &&
+        write_all(_fd, data, size);
+}
+
+std::unique_ptr<session> SessionPool::get() {
+    std::lock_guard<std::mutex> guard(_lock);
+    if(_free.empty())
+        return std::make_unique<session>();
+
+    std::unique_ptr<session> s = std::move(_free.back());
+    _free.pop_back();
+    return s;
+}
+
+// The invocations only depend on the options, so they're kept.  The
+// FileManager isn't: it never looks again for a file it didn't find, or
+// checks whether one it read has changed.  What header search found
+// missing is in the session's stat cache instead, which notices when a
+// directory changes.
+void SessionPool::put(std::unique_ptr<session> s) {
+    std::lock_guard<std::mutex> guard(_lock);
+    s->fm = nullptr;
+    _free.push_back(std::move(s));
+}
+
+static int serve_request(const config &base, Connection &conn,
+                         const std::string &request, SessionPool &pool) {
+    FrameBuf outbuf(conn);
+    std::ostream out(&outbuf);
+    FrameStream diag(conn);
+    config sys;
+    int result = 1;
+
+    sys.diagnostics = &diag;
+
+    // getopt may permute argv, so give it a copy it can own
+    std::vector<std::string> args;
+    args.push_back(base.c2ffi_binpath);
+    for(size_t i = 0, end; (end = request.find('\0', i)) != std::string::npos; i = end + 1)
+        args.push_back(request.substr(i, end - i));
+
+    std::vector<char*> cargs;
+    for(auto &&arg : args)
+        cargs.push_back(&arg[0]);
+    cargs.push_back(NULL);
+
+    bool parsed = process_args(sys, (int)args.size(), cargs.data());
+
+    // Own what the options opened, whether or not the request is served
+    std::unique_ptr<OutputDriver> od(sys.od);
+    std::unique_ptr<std::ostream> file(sys.output != &std::cout ? sys.output : NULL);
+    std::unique_ptr<std::ofstream> macro_output(sys.macro_output);
+    std::unique_ptr<std::ofstream> template_output(sys.template_output);
+
+    // The server's --stat-cache serves every request that doesn't name one
+    if(sys.stat_cache.empty())
+        sys.stat_cache = base.stat_cache;
+
+    // The prelude is the prefix header of every request without its own,
+    // precompiled once for each set of options
+    if(!base.prelude.empty() && sys.prefix_header.empty() && sys.pch.empty()) {
+        sys.prefix_header = base.prelude;
+        sys.pch = keyed_pch(sys, base.prelude, base.pch);
+    }
+
+    if(!parsed) {
+        // already reported
+    } else if(sys.help || !sys.od || sys.watch) {
+        sys.diag() << "Error: --help, --output-dir, --serve and --watch can't be used in a request\n";
+    } else if(sys.filename == "-") {
+        sys.diag() << "Error: A request can't read standard input\n";
+    } else {
+        // Output goes back to the client unless the request gave -o
+        if(!file) {
+            sys.output = &out;
+            od->set_os(&out);
+        }
+
+        std::unique_ptr<session> s = pool.get();
+        result = process_file(sys, s.get());
+        pool.put(std::move(s));
+    }
+
+    out.flush();
+    diag.flush();
+    return result;
+}
+
+static void serve_connection(const config &sys, int fd, SessionPool &pool) {
+    Connection conn(fd);
+    std::string payload;
+    char type;
+
+    while(conn.read_frame(type, payload)) {
+        if(type != REQUEST) {
+            std::string msg = std::string("Error: Unknown frame type: ") + type + "\n";
+            conn.write_frame(DIAGNOSTICS, msg.data(), msg.size());
+            break;
+        }
+
+        std::string status = std::to_string(serve_request(sys, conn, payload, pool));
+        conn.write_frame(STATUS, status.data(), status.size());
+    }
+}
+
+// The PCH of --prelude, rebuilt if the prelude or a file it includes
+// changed.  False if that failed.
+static bool update_prelude(const config &sys) {
+    if(sys.prelude.empty())
+        return true;
+
+    config base = sys;
+    base.pch.clear();
+    return update_pch(base, sys.prelude, keyed_pch(base, sys.prelude, sys.pch));
+}
+
+// Set S up from the serve command line: the invocation its options give
+// a .h header.  With --prelude, the prelude is precompiled as well.
+static bool warm_up(const config &sys, session &s) {
+    config c = sys;
+
+    // the driver doesn't look at the file
+    c.filename = "prelude.h";
+    get_invocation(c, s);
+    s.fm = nullptr;
+
+    return update_prelude(sys);
+}
+
+static char socket_path[sizeof(sockaddr_un::sun_path)];
+
+static void remove_socket(int sig) {
+    unlink(socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static int listen_on(const config &sys) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if(sys.serve_path.size() >= sizeof(addr.sun_path)) {
+        sys.diag() << "Error: Socket path too long: " << sys.serve_path << "\n";
+        return -1;
+    }
+    strcpy(addr.sun_path, sys.serve_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        sys.diag() << "Error: socket: " << strerror(errno) << "\n";
+        return -1;
+    }
+
+    // A socket left behind by a server that was killed is replaced, but
+    // not one that is still being served.
+    struct stat buf;
+    if(lstat(addr.sun_path, &buf) == 0 && S_ISSOCK(buf.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = connect(probe, (sockaddr*)&addr, sizeof(addr)) == 0;
+        close(probe);
+
+        if(live) {
+            sys.diag() << "Error: Already being served: " << sys.serve_path << "\n";
+            close(fd);
+            return -1;
+        }
+        unlink(addr.sun_path);
+    }
+
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        sys.diag() << "Error: Could not listen on " << sys.serve_path << ": "
+                   << strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+
+    strcpy(socket_path, addr.sun_path);
+    signal(SIGINT, remove_socket);
+    signal(SIGTERM, remove_socket);
+    signal(SIGPIPE, SIG_IGN);
+
+    return fd;
+}
+
+static int serve_threaded(const config &sys, int fd, session &warm) {
+    SessionPool pool;
+    std::mutex lock;
+    std::condition_variable done;
+    size_t running = 0;
+
+    pool.put(std::make_unique<session>(warm));
+
+    for(;;) {
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if(conn < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            sys.diag() << "Error: accept: " << strerror(errno) << "\n";
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running++;
+        }
+
+        std::thread([&, conn] {
+            serve_connection(sys, conn, pool);
+
+            std::lock_guard<std::mutex> guard(lock);
+            if(--running == 0)
+                done.notify_all();
+        }).detach();
+    }
+
+    // The connections still open use the pool and sys, so they're
+    // finished before those go away.  Nobody new can connect meanwhile.
+    unlink(socket_path);
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&] { return running == 0; });
+    return 1;
+}
+
+static int child_pipe[2];
+
+static void child_exited(int) {
+    int saved = errno;
+    char c = 0;
+    if(write(child_pipe[1], &c, 1) < 0) { }
+    errno = saved;
+}
+
+// A child that crashed can't answer for itself, so the parent finishes
+// the request it was working on.
+static void reap_children(std::map<pid_t, int> &children) {
+    pid_t pid;
+    int status;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = children.find(pid);
+        if(it == children.end())
+            continue;
+
+        Connection conn(it->second);
+        children.erase(it);
+
+        if(WIFSIGNALED(status)) {
+            std::string msg = std::string("Error: c2ffi crashed: ") +
+                strsignal(WTERMSIG(status)) + "\n";
+            std::string code = std::to_string(128 + WTERMSIG(status));
+            conn.write_frame(DIAGNOSTICS, msg.data(), msg.size());
+            conn.write_frame(STATUS, code.data(), code.size());
+        }
+    }
+}
+
+// The parent never starts a thread, so each child gets a consistent copy
+// of its warm session for free.
+static int serve_forked(const config &sys, int fd, session &warm) {
+    std::map<pid_t, int> children;
+
+    if(pipe2(child_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        sys.diag() << "Error: pipe: " << strerror(errno) << "\n";
+        return 1;
+    }
+    signal(SIGCHLD, child_exited);
+
+    for(;;) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { child_pipe[0], POLLIN, 0 } };
+
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            sys.diag() << "Error: poll: " << strerror(errno) << "\n";
+            return 1;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            char buf[64];
+            while(read(child_pipe[0], buf, sizeof(buf)) > 0) { }
+            reap_children(children);
+        }
+
+        if(!(fds[0].revents & POLLIN))
+            continue;
+
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if(conn < 0) {
+            if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+
+            sys.diag() << "Error: accept: " << strerror(errno) << "\n";
+            return 1;
+        }
+
+        // Rebuilt here, if the prelude changed, rather than by every child
+        update_prelude(sys);
+
+        pid_t pid = fork();
+        if(pid == 0) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+
+            // Other clients must see EOF when their own child is done
+            for(auto &&child : children)
+                close(child.second);
+            close(child_pipe[0]);
+            close(child_pipe[1]);
+            close(fd);
+
+            SessionPool pool;
+            pool.put(std::make_unique<session>(warm));
+            serve_connection(sys, conn, pool);
+            _exit(0);
+        }
+
+        if(pid < 0) {
+            Connection failed(conn);
+            std::string msg = std::string("Error: fork: ") + strerror(errno) + "\n";
+            failed.write_frame(DIAGNOSTICS, msg.data(), msg.size());
+            failed.write_frame(STATUS, "1", 1);
+            continue;
+        }
+
+        children[pid] = conn;
+    }
+}
+
+int c2ffi::serve(config &sys) {
+    session warm;
+    warm.stat_cache = StatCache::get(sys.stat_cache);
+
+    if(!sys.prelude.empty() && sys.pch.empty())
+        sys.pch = sys.serve_path + ".pch";
+    if(!warm_up(sys, warm))
+        return 1;
+
+    int fd = listen_on(sys);
+    if(fd < 0)
+        return 1;
+
+    int result = sys.serve_fork ? serve_forked(sys, fd, warm)
+                                : serve_threaded(sys, fd, warm);
+
+    unlink(socket_path);
+    close(fd);
+    return result;
+}
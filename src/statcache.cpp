@@ -0,0 +1,207 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
+
+#include "c2ffi.h"
+#include "c2ffi/cache.h"
+#include "c2ffi/statcache.h"
+
+using namespace c2ffi;
+
+// A directory changed this recently could change again within the same
+// mtime tick, which on some NFS servers is a whole second
+static const int64_t stable_ns = 2000000000;
+
+static int64_t mtime_ns(const llvm::vfs::Status &st) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        st.getLastModificationTime().time_since_epoch()).count();
+}
+
+namespace {
+    // One per FileManager, which checks each directory once per run.  A
+    // batch keeps its FileManager from one input to the next.
+    class FSCache : public clang::FileSystemStatCache {
+        std::shared_ptr<StatCache> _cache;
+        std::set<std::string> _checked;
+        unsigned _run;
+
+    public:
+        FSCache(std::shared_ptr<StatCache> cache) : _cache(cache), _run(cache->run()) { }
+
+        std::error_code getStat(llvm::StringRef path, llvm::vfs::Status &status,
+                                bool isFile, std::unique_ptr<llvm::vfs::File> *f,
+                                llvm::vfs::FileSystem &fs) override {
+            llvm::SmallString<256> abs(path);
+            fs.makeAbsolute(abs);
+            llvm::sys::path::remove_dots(abs);
+
+            std::string dir = llvm::sys::path::parent_path(abs).str();
+            std::string name = llvm::sys::path::filename(abs).str();
+
+            if(_run != _cache->run()) {
+                _run = _cache->run();
+                _checked.clear();
+            }
+
+            if(_checked.insert(dir).second)
+                _cache->validate(dir, fs);
+
+            if(_cache->is_missing(dir, name))
+                return std::make_error_code(std::errc::no_such_file_or_directory);
+
+            std::error_code ec = FileSystemStatCache::get(path, status, isFile, f, nullptr, fs);
+            if(ec == std::errc::no_such_file_or_directory)
+                _cache->add_missing(dir, name);
+
+            return ec;
+        }
+    };
+}
+
+StatCache::StatCache(const std::string &path)
+    : _path(path), _dirty(false), _run(0) {
+    std::ifstream in(path);
+    std::string line;
+    dir *d = NULL;
+
+    if(!std::getline(in, line) || line != "c2ffi-stat-cache 1")
+        return;
+
+    // "D <mtime> <dir>", then "- <name>" for each file missing from it
+    while(std::getline(in, line)) {
+        if(line.size() < 2)
+            continue;
+
+        if(line[0] == 'D') {
+            std::istringstream ls(line.substr(2));
+            int64_t mtime;
+            std::string path;
+
+            if(!(ls >> mtime) || ls.get() != ' ' || !std::getline(ls, path))
+                return;
+
+            d = &_dirs[path];
+            d->mtime = mtime;
+        } else if(line[0] == '-' && d) {
+            d->missing.insert(line.substr(2));
+        }
+    }
+}
+
+std::shared_ptr<StatCache> StatCache::get(const std::string &path) {
+    static std::mutex lock;
+    static std::map<std::string, std::shared_ptr<StatCache>> caches;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto &cache = caches[path];
+    if(!cache)
+        cache.reset(new StatCache(path));
+
+    return cache;
+}
+
+void StatCache::validate(const std::string &path, llvm::vfs::FileSystem &fs) {
+    auto st = fs.status(path);
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    dir &d = _dirs[path];
+
+    if(!st || !st->isDirectory()) {
+        d = dir();
+        return;
+    }
+
+    if(d.mtime != mtime_ns(*st)) {
+        d.mtime = mtime_ns(*st);
+        d.missing.clear();
+        _dirty = true;
+    }
+
+    // The embedded resource headers' directories have no mtime to check,
+    // and cost nothing to look in anyway
+    d.stable = (d.mtime != 0 && now - d.mtime > stable_ns);
+}
+
+bool StatCache::is_missing(const std::string &path, const std::string &name) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _dirs.find(path);
+
+    return it != _dirs.end() && it->second.stable && it->second.missing.count(name);
+}
+
+void StatCache::add_missing(const std::string &path, const std::string &name) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _dirs.find(path);
+
+    if(it != _dirs.end() && it->second.stable && it->second.missing.insert(name).second)
+        _dirty = true;
+}
+
+std::unique_ptr<clang::FileSystemStatCache> StatCache::make_fs_cache() {
+    return std::unique_ptr<clang::FileSystemStatCache>(new FSCache(get(_path)));
+}
+
+void StatCache::save() {
+    std::ostringstream out;
+
+    if(_path.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if(!_dirty)
+            return;
+
+        out << "c2ffi-stat-cache 1\n";
+        for(auto &&d : _dirs) {
+            if(!d.second.stable || d.second.missing.empty())
+                continue;
+
+            out << "D " << d.second.mtime << ' ' << d.first << '\n';
+            for(auto &&name : d.second.missing)
+                out << "- " << name << '\n';
+        }
+
+        _dirty = false;
+    }
+
+    std::string data = out.str();
+    replace_file(_path, data.data(), data.size());
+}
+
+void c2ffi::new_stat_cache_run(const config &c) {
+    if(!c.stat_cache.empty())
+        StatCache::get(c.stat_cache)->new_run();
+}
+
+void c2ffi::save_stat_cache(const config &c) {
+    if(!c.stat_cache.empty())
+        StatCache::get(c.stat_cache)->save();
+}
@@ -0,0 +1,231 @@
+/*
+    c2ffi
+    Copyright (C) 2013  Ryan Pavlik
+
+    This file is part of c2ffi.
+
+    c2ffi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    c2ffi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with c2ffi.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+
+#include "c2ffi.h"
+#include "c2ffi/init.h"
+#include "c2ffi/opt.h"
+#include "c2ffi/pch.h"
+#include "c2ffi/process.h"
+#include "c2ffi/resources.h"
+#include "c2ffi/watch.h"
+
+using namespace c2ffi;
+
+// How long a burst of changes, such as an editor saving, has to settle
+static const int settle_ms = 100;
+
+// OUT was opened on FILE by the options, and the last round closed it
+static void reopen(std::ofstream *out, const std::string &file) {
+    out->close();
+    out->clear();
+    out->open(file);
+}
+
+// Every round writes its output files afresh, through the streams the
+// options opened
+static int emit(config &sys, clang::ASTUnit &unit, clang::DiagnosticConsumer &printer) {
+    if(!sys.output_file.empty())
+        reopen(static_cast<std::ofstream*>(sys.output), sys.output_file);
+    if(sys.macro_output)
+        reopen(sys.macro_output, sys.macro_file);
+    if(sys.template_output)
+        reopen(sys.template_output, sys.template_file);
+
+    // The unit ended the source file when it finished parsing
+    printer.BeginSourceFile(unit.getLangOpts(), &unit.getPreprocessor());
+    int r = process_unit(sys, unit);
+    printer.EndSourceFile();
+
+    return r;
+}
+
+// The files read for the main file, and those in the preamble and any
+// PCH, which the unit only knows through their source locations
+static std::set<std::string> unit_files(clang::ASTUnit &unit) {
+    clang::SourceManager &sm = unit.getSourceManager();
+    std::set<std::string> files;
+
+    for(auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it)
+        files.insert(it->first->getName().str());
+
+    for(unsigned i = 0; i < sm.loaded_sloc_entry_size(); i++) {
+        bool invalid = false;
+        const clang::SrcMgr::SLocEntry &e = sm.getLoadedSLocEntry(i, &invalid);
+
+        if(!invalid && e.isFile()) {
+            const clang::FileEntry *fe = e.getFile().getContentCache()->OrigEntry;
+            if(fe)
+                files.insert(fe->getName().str());
+        }
+    }
+
+    return files;
+}
+
+// Watches are added afresh each time, as editors often save by replacing
+// the file, which ends the watch on the old one
+static bool wait_for_change(config &sys, int fd, const std::set<std::string> &files) {
+    std::vector<int> wds;
+
+    for(auto &&file : files) {
+        int wd = inotify_add_watch(fd, file.c_str(),
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                   IN_MOVE_SELF | IN_DELETE_SELF);
+        if(wd >= 0)
+            wds.push_back(wd);
+    }
+
+    if(wds.empty()) {
+        sys.diag() << "Error: Could not watch " << sys.filename << ": "
+                   << strerror(errno) << "\n";
+        return false;
+    }
+
+    struct pollfd p = { fd, POLLIN, 0 };
+    char buf[4096];
+    int n;
+
+    while((n = poll(&p, 1, -1)) < 0 && errno == EINTR)
+        ;
+
+    while(n > 0) {
+        if(read(fd, buf, sizeof(buf)) < 0 && errno != EINTR)
+            break;
+        n = poll(&p, 1, settle_ms);
+    }
+
+    for(int wd : wds)
+        inotify_rm_watch(fd, wd);
+
+    return true;
+}
+
+// Rebuild the --prefix-header PCH if it's out of date, as a run without
+// --watch does.  REBUILT says whether it was.  False if the build failed.
+static bool update_prefix(config &sys, bool &rebuilt) {
+    struct stat before{}, after{};
+
+    rebuilt = false;
+    if(sys.prefix_header.empty())
+        return true;
+
+    config base = sys;
+    base.pch.clear();
+    stat(sys.pch.c_str(), &before);
+    if(!update_pch(base, sys.prefix_header, sys.pch))
+        return false;
+
+    // A rebuilt PCH is renamed into place, so it's a different inode
+    stat(sys.pch.c_str(), &after);
+    rebuilt = before.st_ino != after.st_ino || before.st_mtime != after.st_mtime;
+    return true;
+}
+
+// Build the preamble on the first parse, rather than waiting to see the
+// file parsed more than once.  The files are read rather than mapped,
+// since they are expected to change under the unit.
+static std::unique_ptr<clang::ASTUnit> load_unit(config &sys,
+        std::shared_ptr<clang::CompilerInvocation> cinv,
+        std::shared_ptr<clang::PCHContainerOperations> pch_ops,
+        llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags) {
+    std::unique_ptr<clang::ASTUnit> unit = clang::ASTUnit::LoadFromCompilerInvocation(
+        cinv, pch_ops, diags, new clang::FileManager(cinv->getFileSystemOpts(), file_system()),
+        false, clang::CaptureDiagsKind::None, 1, clang::TU_Complete, false, false,
+        true);
+    if(!unit)
+        sys.diag() << "Error: Could not parse " << sys.filename << "\n";
+
+    return unit;
+}
+
+int c2ffi::watch(config &sys) {
+    if(is_ast_file(sys)) {
+        sys.diag() << "Error: --watch needs a source file\n";
+        return 1;
+    }
+
+    session s;
+    bool rebuilt;
+    std::shared_ptr<clang::CompilerInvocation> cinv = get_unit_invocation(sys, s);
+    if(!cinv || !update_prefix(sys, rebuilt))
+        return 1;
+
+    auto *printer = new clang::TextDiagnosticPrinter(sys.diag(), &cinv->getDiagnosticOpts());
+    auto diags = clang::CompilerInstance::createDiagnostics(&cinv->getDiagnosticOpts(), printer);
+    auto pch_ops = std::make_shared<clang::PCHContainerOperations>();
+
+    std::unique_ptr<clang::ASTUnit> unit = load_unit(sys, cinv, pch_ops, diags);
+    if(!unit)
+        return 1;
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if(fd < 0) {
+        sys.diag() << "Error: Could not start watching: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    for(;;) {
+        emit(sys, *unit, *printer);
+
+        // A prefix header that doesn't build is reported, and waited out
+        std::set<std::string> files = unit_files(*unit);
+        bool changed;
+        while((changed = wait_for_change(sys, fd, files)) && !update_prefix(sys, rebuilt))
+            ;
+        if(!changed)
+            break;
+
+        if(rebuilt) {
+            // The unit and its preamble were built on the old PCH
+            cinv = get_unit_invocation(sys, s);
+            unit = cinv ? load_unit(sys, cinv, pch_ops, diags) : nullptr;
+            if(!unit)
+                break;
+        } else {
+            // The preamble is only rebuilt if something in it changed
+            unit->Reparse(pch_ops);
+        }
+    }
+
+    close(fd);
+    return 1;
+}